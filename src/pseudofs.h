@@ -44,6 +44,10 @@
 struct mntarg;
 struct mount;
 struct nameidata;
+struct pfs_bitmap;
+struct pfs_index;
+struct pfs_nametab;
+struct pfs_vncache;
 struct proc;
 struct sbuf;
 struct statfs;
@@ -56,8 +60,11 @@ struct vnode;
  * Limits and constants
  */
 #define PFS_NAMELEN		128
+#define PFS_BLOOM_BITS		512	/* per-directory name filter */
 #define PFS_FSNAMELEN	MFSNAMELEN	/* equal to MFSNAMELEN */
 #define PFS_DELEN		(offsetof(struct dirent, d_name) + PFS_NAMELEN)
+#define PFS_DIRENTRYLEN	\
+	((offsetof(struct direntry, d_name) + PFS_NAMELEN + 7) & ~7)
 
 typedef enum {
 	pfstype_none = 0,
@@ -88,6 +95,7 @@ typedef enum {
  */
 struct pfs_info;
 struct pfs_node;
+struct pfs_vdata;
 
 /*
  * Init / uninit callback
@@ -193,9 +201,9 @@ typedef int (*pfs_destroy_t)(PFS_DESTROY_ARGS);
 /*
  * pfs_info: describes a pseudofs instance
  *
- * The pi_mutex is only used to avoid using the global subr_unit lock
- * for unrhdr.  The rest of struct pfs_info is only modified during
- * vfs_init() and vfs_uninit() of the consumer filesystem.
+ * The pi_mutex protects the file number bitmap, pi_bitmap.  The rest
+ * of struct pfs_info is only modified during vfs_init() and vfs_uninit()
+ * of the consumer filesystem.
  */
 struct pfs_info {
 	char			 pi_name[PFS_FSNAMELEN];
@@ -205,7 +213,8 @@ struct pfs_info {
 	/* members below this line are initialized at run time */
 	struct pfs_node		*pi_root;
 	lck_mtx_t		 *pi_mutex;
-	struct unrhdr		*pi_unrhdr;
+	struct pfs_bitmap	*pi_bitmap;
+	struct pfs_vncache	*pi_vncache;
 };
 
 /*
@@ -215,6 +224,11 @@ struct pfs_info {
  * - Fields marked (p) are protected by the node's parent's mutex.
  * - Remaining fields are not protected by any lock and are assumed to be
  *   immutable once the node has been created.
+ * - pn_refs counts one reference for the tree and one for every vnode
+ *   cache entry, so a node outlives pfs_destroy() until the last vnode
+ *   that points to it has been reclaimed.
+ * - pn_bloom is only written under the node's mutex, but may be read
+ *   without it.
  *
  * To prevent deadlocks, if a node's mutex is to be held at the same time
  * as its parent's (e.g. when adding or removing nodes to a directory),
@@ -222,10 +236,6 @@ struct pfs_info {
  * is not enforcable by WITNESS.
  */
 struct pfs_node {
-	struct vnode 	*pfs_lowervp;     /* VREFed once */
-	struct vnode 	*pfs_vnode;       /* Back pointer */
-	uint32_t		 pfs_lowervid;    /* vid for lowervp to detect lowervp getting recycled out from under us */
-	uint32_t 		 pfs_myvid;
 	char			 pn_name[PFS_NAMELEN];
 	pfs_type_t		 pn_type;
 	int			 pn_flags;
@@ -242,11 +252,21 @@ struct pfs_node {
 
 	struct pfs_info		*pn_info;
 	u_int32_t		 pn_fileno;		/* (o) */
+	uint32_t		 pn_namehash;		/* pfs_namehash(pn_name) */
 
 	struct pfs_node		*pn_parent;		/* (o) */
 	struct pfs_node		*pn_nodes;		/* (o) */
 	struct pfs_node		*pn_last_node;		/* (o) */
 	struct pfs_node		*pn_next;		/* (p) */
+	u_int			 pn_nchildren;		/* (o) */
+	struct pfs_index	*pn_index;		/* (o) */
+	struct pfs_nametab	*pn_names;		/* (o) */
+	uint64_t		 pn_bloom[PFS_BLOOM_BITS / 64];	/* (o) */
+	struct pfs_node		*pn_hashnext;		/* (p) */
+
+	LIST_HEAD(, pfs_vdata)	 pn_vdata;		/* (o) cached vnodes */
+	int			 pn_dead;		/* (o) being destroyed */
+	int32_t			 pn_refs;		/* updated atomically */
 };
 
 /*
@@ -261,7 +281,7 @@ int		 pfs_root	(struct mount *mp, int flags,
 int		 pfs_statfs	(struct mount *mp, struct statfs *sbp);
 int		 pfs_init	(struct pfs_info *pi, struct vfsconf *vfc);
 int		 pfs_uninit	(struct pfs_info *pi, struct vfsconf *vfc);
-int 	 pfs_getnewvnode(struct mount * mp, struct vnode * lowervp, struct vnode * dvp, struct vnode ** vpp, struct componentname * cnp, int root);
+int 	 pfs_getnewvnode(struct mount * mp, struct vnode * lowervp, struct vnode * dvp, struct vnode ** vpp, struct componentname * cnp, int root, void * fsnode);
 int		 pfs_pcansee(struct thread *td, struct proc *p);
 int 	 pfs_uiomove_frombuf(void *buf, int buflen, struct uio *uio);
 
@@ -31,6 +31,7 @@
 #include <sys/cdefs.h>
 __FBSDID("$FreeBSD$");
 
+#include <kern/cpu_number.h>
 #include <kern/locks.h>
 
 #include <sys/param.h>
@@ -47,6 +48,291 @@ __FBSDID("$FreeBSD$");
 #include "pseudofs_internal.h"
 #include "xnu_compat.h"
 
+static MALLOC_DEFINE(M_PFSFILENO, "pfs_fileno", "pseudofs file number map");
+
+static int pfs_fileno_stable;
+SYSCTL_INT(_vfs_pfs, OID_AUTO, stable_filenos, CTLFLAG_RW,
+    &pfs_fileno_stable, 0,
+    "derive file numbers from node paths in file systems initialized later");
+
+/*
+ * File number bitmap
+ *
+ * Free file numbers are kept as set bits in a three-level bitmap.  Each
+ * leaf word covers 64 numbers; a bit in a summary word is set when the
+ * leaf word below it has a free number, and a bit in the top word is set
+ * when the summary word below it does.  Finding the lowest free number is
+ * therefore one count-trailing-zeros per level, and both allocation and
+ * release touch at most one word per level.  The top word limits the map
+ * to 64 * 64 * 64 numbers.  The map is protected by pi_mutex.
+ *
+ * So that building a large tree does not serialize on pi_mutex, each CPU
+ * reserves PFS_FILENO_BATCH numbers at a time from the map and hands them
+ * out from its own slot, which only that CPU normally locks.  Released
+ * numbers go back to the slot of the releasing CPU; a full slot returns
+ * a batch to the map.  Lock order: CPU slot lock, then pi_mutex.
+ *
+ * Numbers handed out this way depend on the order in which nodes are
+ * created.  If vfs.pfs.stable_filenos is set when a file system is
+ * initialized, each of its nodes is instead given the first free number
+ * at or after a hash of its path below pi_root, so the same tree gets the
+ * same numbers after a remount or reload; a collision simply moves on to
+ * the next free number.  The CPU slots are not used in that mode, since
+ * numbers reserved by them could not be found at their hashed position.
+ */
+#define PFS_FILENO_BITS		64
+#define PFS_FILENO_LIMIT	(PFS_FILENO_BITS * PFS_FILENO_BITS * PFS_FILENO_BITS)
+#define PFS_FILENO_FIRST	3	/* 0 and 1 are unused, 2 is the root */
+#define PFS_FILENO_NCPU		64
+#define PFS_FILENO_BATCH	16
+
+#define PFS_FILENO_MASK(b) \
+	((b) >= PFS_FILENO_BITS ? 0 : ~0ULL << (b))	/* bits b and up */
+
+struct pfs_filenocpu {
+	lck_mtx_t		*fc_lock;
+	u_int			 fc_count;
+	u_int			 fc_nums[2 * PFS_FILENO_BATCH];
+} __attribute__((aligned(64)));
+
+struct pfs_bitmap {
+	uint64_t		 pb_top;
+	uint64_t		*pb_summary;
+	uint64_t		*pb_leaves;
+	u_int			 pb_nleaves;
+	u_int			 pb_nsummary;
+	u_int			 pb_limit;	/* numbers below this exist */
+	int			 pb_stable;	/* numbers derived from paths */
+	struct pfs_filenocpu	*pb_cpu;	/* PFS_FILENO_NCPU slots */
+	void			*pb_cpumem;	/* pb_cpu as allocated */
+};
+
+#define PFS_FILENO_CPU(pb) \
+	(&(pb)->pb_cpu[cpu_number() & (PFS_FILENO_NCPU - 1)])
+
+static struct pfs_bitmap *
+pfs_bitmap_create(u_int limit)
+{
+	struct pfs_bitmap *pb;
+	u_int i;
+
+	pb = malloc(sizeof *pb, M_PFSFILENO, M_WAITOK | M_ZERO);
+	pb->pb_limit = limit;
+	pb->pb_nleaves = howmany(limit, PFS_FILENO_BITS);
+	pb->pb_nsummary = howmany(pb->pb_nleaves, PFS_FILENO_BITS);
+	pb->pb_leaves = malloc(pb->pb_nleaves * sizeof(uint64_t),
+	    M_PFSFILENO, M_WAITOK | M_ZERO);
+	pb->pb_summary = malloc(pb->pb_nsummary * sizeof(uint64_t),
+	    M_PFSFILENO, M_WAITOK | M_ZERO);
+	for (i = PFS_FILENO_FIRST; i < limit; i++)
+		pb->pb_leaves[i / PFS_FILENO_BITS] |=
+		    1ULL << (i % PFS_FILENO_BITS);
+	for (i = 0; i < pb->pb_nleaves; i++)
+		if (pb->pb_leaves[i] != 0)
+			pb->pb_summary[i / PFS_FILENO_BITS] |=
+			    1ULL << (i % PFS_FILENO_BITS);
+	for (i = 0; i < pb->pb_nsummary; i++)
+		if (pb->pb_summary[i] != 0)
+			pb->pb_top |= 1ULL << i;
+	/* malloc() does not align to a cache line, so round the slots up */
+	pb->pb_cpumem = malloc(PFS_FILENO_NCPU * sizeof(struct pfs_filenocpu) +
+	    __alignof__(struct pfs_filenocpu) - 1, M_PFSFILENO,
+	    M_WAITOK | M_ZERO);
+	pb->pb_cpu = (struct pfs_filenocpu *)roundup(
+	    (uintptr_t)pb->pb_cpumem, __alignof__(struct pfs_filenocpu));
+	for (i = 0; i < PFS_FILENO_NCPU; i++)
+		lck_mtx_init(pb->pb_cpu[i].fc_lock, NULL, LCK_SLEEP_DEFAULT);
+	return (pb);
+}
+
+static void
+pfs_bitmap_destroy(struct pfs_bitmap *pb)
+{
+	int i;
+
+	for (i = 0; i < PFS_FILENO_NCPU; i++)
+		lck_mtx_destroy(pb->pb_cpu[i].fc_lock, NULL);
+	FREE(pb->pb_cpumem, M_PFSFILENO);
+	FREE(pb->pb_summary, M_PFSFILENO);
+	FREE(pb->pb_leaves, M_PFSFILENO);
+	FREE(pb, M_PFSFILENO);
+}
+
+/*
+ * Mark bit b of leaf word l allocated and return its number.
+ */
+static u_int
+pfs_bitmap_take(struct pfs_bitmap *pb, u_int l, u_int b)
+{
+	u_int s;
+
+	s = l / PFS_FILENO_BITS;
+	pb->pb_leaves[l] &= ~(1ULL << b);
+	if (pb->pb_leaves[l] == 0) {
+		pb->pb_summary[s] &= ~(1ULL << (l % PFS_FILENO_BITS));
+		if (pb->pb_summary[s] == 0)
+			pb->pb_top &= ~(1ULL << s);
+	}
+	return (l * PFS_FILENO_BITS + b);
+}
+
+/*
+ * Take the lowest free number, or return 0 if there is none.
+ */
+static u_int
+pfs_bitmap_alloc(struct pfs_bitmap *pb)
+{
+	u_int s, l;
+
+	if (pb->pb_top == 0)
+		return (0);
+	s = __builtin_ctzll(pb->pb_top);
+	l = s * PFS_FILENO_BITS + __builtin_ctzll(pb->pb_summary[s]);
+	return (pfs_bitmap_take(pb, l, __builtin_ctzll(pb->pb_leaves[l])));
+}
+
+/*
+ * Take the first free number at or after start, wrapping around to the
+ * lowest free number, or return 0 if there is none.
+ */
+static u_int
+pfs_bitmap_alloc_at(struct pfs_bitmap *pb, u_int start)
+{
+	uint64_t w;
+	u_int s, l;
+
+	l = start / PFS_FILENO_BITS;
+	w = pb->pb_leaves[l] & PFS_FILENO_MASK(start % PFS_FILENO_BITS);
+	if (w == 0) {
+		/* a later leaf under the same summary word? */
+		s = l / PFS_FILENO_BITS;
+		w = pb->pb_summary[s] &
+		    PFS_FILENO_MASK(l % PFS_FILENO_BITS + 1);
+		if (w == 0) {
+			/* a later summary word? */
+			w = pb->pb_top & PFS_FILENO_MASK(s + 1);
+			if (w == 0)
+				return (pfs_bitmap_alloc(pb));
+			s = __builtin_ctzll(w);
+			w = pb->pb_summary[s];
+		}
+		l = s * PFS_FILENO_BITS + __builtin_ctzll(w);
+		w = pb->pb_leaves[l];
+	}
+	return (pfs_bitmap_take(pb, l, __builtin_ctzll(w)));
+}
+
+/*
+ * FNV-1a hash of the path of a node below pi_root
+ */
+static uint32_t
+pfs_fileno_pathhash(struct pfs_node *pn)
+{
+	const char *cp;
+	uint32_t h;
+
+	if (pn->pn_parent == NULL)
+		return (2166136261U);
+	h = pfs_fileno_pathhash(pn->pn_parent);
+	h = (h ^ '/') * 16777619U;
+	for (cp = pn->pn_name; *cp != '\0'; cp++)
+		h = (h ^ (u_char)*cp) * 16777619U;
+	return (h);
+}
+
+static void
+pfs_bitmap_free(struct pfs_bitmap *pb, u_int fileno)
+{
+	u_int l;
+
+	KASSERT(fileno >= PFS_FILENO_FIRST && fileno < pb->pb_limit,
+	    ("%s(): file number %u out of range", __func__, fileno));
+	l = fileno / PFS_FILENO_BITS;
+	KASSERT((pb->pb_leaves[l] & (1ULL << (fileno % PFS_FILENO_BITS))) == 0,
+	    ("%s(): file number %u is not allocated", __func__, fileno));
+	pb->pb_leaves[l] |= 1ULL << (fileno % PFS_FILENO_BITS);
+	pb->pb_summary[l / PFS_FILENO_BITS] |= 1ULL << (l % PFS_FILENO_BITS);
+	pb->pb_top |= 1ULL << (l / PFS_FILENO_BITS);
+}
+
+/*
+ * Pick a number for a node.  In stable mode it is looked up in the map
+ * at the node's hashed position.  Otherwise it comes from this CPU's
+ * slot, which reserves a batch from the map if it is empty; once the map
+ * is exhausted, numbers that other CPUs reserved are used up before
+ * giving up and returning 0.
+ */
+static u_int
+pfs_fileno_get(struct pfs_node *pn)
+{
+	struct pfs_info *pi;
+	struct pfs_bitmap *pb;
+	struct pfs_filenocpu *fc;
+	u_int fileno;
+	int i;
+
+	pi = pn->pn_info;
+	pb = pi->pi_bitmap;
+	if (pb->pb_stable) {
+		fileno = PFS_FILENO_FIRST + pfs_fileno_pathhash(pn) %
+		    (pb->pb_limit - PFS_FILENO_FIRST);
+		lck_mtx_lock(pi->pi_mutex);
+		fileno = pfs_bitmap_alloc_at(pb, fileno);
+		lck_mtx_unlock(pi->pi_mutex);
+		return (fileno);
+	}
+	fc = PFS_FILENO_CPU(pb);
+	lck_mtx_lock(fc->fc_lock);
+	if (fc->fc_count == 0) {
+		lck_mtx_lock(pi->pi_mutex);
+		while (fc->fc_count < PFS_FILENO_BATCH &&
+		    (fileno = pfs_bitmap_alloc(pb)) != 0)
+			fc->fc_nums[fc->fc_count++] = fileno;
+		lck_mtx_unlock(pi->pi_mutex);
+	}
+	fileno = 0;
+	if (fc->fc_count > 0)
+		fileno = fc->fc_nums[--fc->fc_count];
+	lck_mtx_unlock(fc->fc_lock);
+	for (i = 0; fileno == 0 && i < PFS_FILENO_NCPU; i++) {
+		fc = &pb->pb_cpu[i];
+		lck_mtx_lock(fc->fc_lock);
+		if (fc->fc_count > 0)
+			fileno = fc->fc_nums[--fc->fc_count];
+		lck_mtx_unlock(fc->fc_lock);
+	}
+	return (fileno);
+}
+
+/*
+ * Give a number back to this CPU's slot, first returning a batch to the
+ * map if the slot is full.  In stable mode it goes straight to the map.
+ */
+static void
+pfs_fileno_put(struct pfs_info *pi, u_int fileno)
+{
+	struct pfs_bitmap *pb;
+	struct pfs_filenocpu *fc;
+
+	pb = pi->pi_bitmap;
+	if (pb->pb_stable) {
+		lck_mtx_lock(pi->pi_mutex);
+		pfs_bitmap_free(pb, fileno);
+		lck_mtx_unlock(pi->pi_mutex);
+		return;
+	}
+	fc = PFS_FILENO_CPU(pb);
+	lck_mtx_lock(fc->fc_lock);
+	if (fc->fc_count == 2 * PFS_FILENO_BATCH) {
+		lck_mtx_lock(pi->pi_mutex);
+		while (fc->fc_count > PFS_FILENO_BATCH)
+			pfs_bitmap_free(pb, fc->fc_nums[--fc->fc_count]);
+		lck_mtx_unlock(pi->pi_mutex);
+	}
+	fc->fc_nums[fc->fc_count++] = fileno;
+	lck_mtx_unlock(fc->fc_lock);
+}
+
 /*
  * Initialize fileno bitmap
  */
@@ -55,7 +341,8 @@ pfs_fileno_init(struct pfs_info *pi)
 {
 
 	lck_mtx_init(pi->pi_mutex, NULL, LCK_SLEEP_DEFAULT);
-//	pi->pi_unrhdr = new_unrhdr(3, INT_MAX / NO_PID, pi->pi_mutex);
+	pi->pi_bitmap = pfs_bitmap_create(PFS_FILENO_LIMIT);
+	pi->pi_bitmap->pb_stable = pfs_fileno_stable;
 }
 
 /*
@@ -65,8 +352,8 @@ void
 pfs_fileno_uninit(struct pfs_info *pi)
 {
 
-//	delete_unrhdr(pi->pi_unrhdr);
-//	pi->pi_unrhdr = NULL;
+	pfs_bitmap_destroy(pi->pi_bitmap);
+	pi->pi_bitmap = NULL;
 	lck_mtx_destroy(pi->pi_mutex, NULL);
 }
 
@@ -92,7 +379,10 @@ pfs_fileno_alloc(struct pfs_node *pn)
 	case pfstype_file:
 	case pfstype_symlink:
 	case pfstype_procdir:
-//		pn->pn_fileno = alloc_unr(pn->pn_info->pi_unrhdr);
+		pn->pn_fileno = pfs_fileno_get(pn);
+		if (pn->pn_fileno == 0)
+			printf("%s: out of file numbers for %s\n",
+			    pn->pn_info->pi_name, pn->pn_name);
 		break;
 	case pfstype_this:
 		KASSERT(pn->pn_parent != NULL,
@@ -139,13 +429,16 @@ pfs_fileno_free(struct pfs_node *pn)
 
 	switch (pn->pn_type) {
 	case pfstype_root:
-		/* not allocated from unrhdr */
+		/* not allocated from the bitmap */
 		return;
 	case pfstype_dir:
 	case pfstype_file:
 	case pfstype_symlink:
 	case pfstype_procdir:
-//		free_unr(pn->pn_info->pi_unrhdr, pn->pn_fileno);
+		if (pn->pn_fileno == 0)
+			break;
+		pfs_fileno_put(pn->pn_info, pn->pn_fileno);
+		pn->pn_fileno = 0;
 		break;
 	case pfstype_this:
 	case pfstype_parent:
@@ -40,22 +40,159 @@ SYSCTL_DECL(_vfs_pfs);
 
 /*
  * Vnode data
+ *
+ * Besides its hash chain, each entry sits on the pn_vdata list of its
+ * node, which is protected by the node's mutex.  PVD_NODELIST tells
+ * whether it is still there; pfs_purge() takes entries off the list
+ * before the node goes away.  Entries for a process (pvd_pid != NO_PID)
+ * are likewise kept on the list of a per-pid record, so that process
+ * exit can find them without scanning the cache, and on the CLOCK ring
+ * from which idle entries are evicted when the cache is over its limit.
+ * The hash chain belongs to the cache instance of the entry's pfs_info,
+ * pvd_cache; PVD_HASHED tells whether the entry is still linked there.
+ * The entry holds a reference on both its node and its cache instance.
  */
 struct pfs_vdata {
 	struct pfs_node	*pvd_pn;
+	struct pfs_vncache *pvd_cache;
 	pid_t		 pvd_pid;
+	uint32_t	 pvd_flags;	/* updated atomically */
 	struct vnode	*pvd_vnode;
+	uint32_t	 pvd_vid;	/* vnode_vid(pvd_vnode) */
+	u_long		 pvd_hashval;	/* hash of (pn, pid, mount) */
 	SLIST_ENTRY(pfs_vdata) pvd_hash;
+	LIST_ENTRY(pfs_vdata) pvd_nodelink;
+	LIST_ENTRY(pfs_vdata) pvd_pidlink;
+	LIST_ENTRY(pfs_vdata) pvd_pinlink;
+	struct pfs_vnpid *pvd_pidrec;
+	SLIST_ENTRY(pfs_vdata) pvd_limbo;	/* awaiting deferred free */
+	TAILQ_ENTRY(pfs_vdata) pvd_clock;	/* eviction ring */
+	TAILQ_ENTRY(pfs_vdata) pvd_reclaim;	/* reclaim queue */
+	uint64_t	 pvd_queued;	/* when put on the reclaim queue */
 };
 
+#define PVD_NODELIST	0x0001	/* on pvd_pn->pn_vdata */
+#define PVD_PIDLIST	0x0002	/* on pvd_pidrec->pp_vdata */
+#define PVD_DEAD	0x0004	/* freed, lookups must ignore it */
+#define PVD_CLOCK	0x0008	/* on the eviction ring */
+#define PVD_REFERENCED	0x0010	/* hit since the clock hand last passed */
+#define PVD_RECLAIM	0x0020	/* on the reclaim queue */
+#define PVD_PINNED	0x0040	/* prewarmed, holds a use reference */
+#define PVD_HASHED	0x0080	/* on a hash chain of pvd_cache */
+
+/*
+ * Node references
+ */
+void	 pfs_node_hold		(struct pfs_node *);
+void	 pfs_node_rele		(struct pfs_node *);
+
+/*
+ * Directory index
+ *
+ * Once a directory has PFS_INDEX_MIN children, they are also kept in a
+ * hash table keyed by pn_namehash, so that lookups do not have to walk
+ * pn_nodes.  The table doubles whenever the directory has twice as many
+ * children as buckets.  It is protected by the directory's mutex, and a
+ * directory whose table could not be allocated simply goes without.
+ */
+#define PFS_INDEX_MIN		32
+
+struct pfs_index {
+	struct pfs_node	**pix_buckets;
+	u_int		 pix_mask;
+	struct pfs_node	*pix_procdir;	/* the procdir child, if any */
+};
+
+/*
+ * Directories below that size keep a packed array of their children's
+ * name hashes, lengths and first PFS_NAMEPREFIX bytes instead, so that a
+ * lookup scans one contiguous array and compares a whole prefix at a time
+ * before it dereferences any node.  It too is protected by the
+ * directory's mutex, and is dropped once the directory is indexed.
+ */
+#define PFS_NAMEPREFIX		16
+
+struct pfs_nameent {
+	uint64_t	 pne_prefix[PFS_NAMEPREFIX / sizeof(uint64_t)];
+	uint32_t	 pne_hash;
+	uint32_t	 pne_len;
+	struct pfs_node	*pne_node;
+};
+
+struct pfs_nametab {
+	u_int		 pnt_count;
+	u_int		 pnt_size;
+	struct pfs_node	*pnt_procdir;	/* the procdir child, if any */
+	struct pfs_nameent pnt_ents[];
+};
+
+static inline uint32_t
+pfs_namehash(const char *name, size_t len)
+{
+	uint32_t h;
+
+	/* FNV-1a */
+	h = 2166136261U;
+	while (len-- > 0)
+		h = (h ^ (u_char)*name++) * 16777619U;
+	return (h);
+}
+
+/*
+ * Every directory also keeps a Bloom filter of its children's names,
+ * two bits per name taken from pn_namehash, which lookups test without
+ * taking the directory's mutex.  A bit is set before the child is linked
+ * in, and the filter is recomputed as a whole when a child is detached,
+ * one word at a time so that the bits of the remaining children stay set
+ * throughout.  A clear bit therefore proves that no child of that name
+ * existed when the test started.
+ *
+ * Once a directory has an index, its filter would be mostly set bits and
+ * the index answers a miss about as fast, so the filter is neither tested
+ * nor recomputed; it only keeps collecting bits, so that it still covers
+ * every child should the index go away.
+ */
+#define PFS_BLOOM_BIT0(h)	((h) % PFS_BLOOM_BITS)
+#define PFS_BLOOM_BIT1(h)	(((h) >> 16) % PFS_BLOOM_BITS)
+
+static inline void
+pfs_bloom_set(uint64_t *bloom, uint32_t hash)
+{
+
+	bloom[PFS_BLOOM_BIT0(hash) / 64] |= 1ULL << (PFS_BLOOM_BIT0(hash) % 64);
+	bloom[PFS_BLOOM_BIT1(hash) / 64] |= 1ULL << (PFS_BLOOM_BIT1(hash) % 64);
+}
+
+static inline int
+pfs_bloom_test(struct pfs_node *pd, uint32_t hash)
+{
+	volatile uint64_t *bloom;
+
+	if (pd->pn_index != NULL)
+		return (1);
+	bloom = pd->pn_bloom;
+	return ((bloom[PFS_BLOOM_BIT0(hash) / 64] &
+	    (1ULL << (PFS_BLOOM_BIT0(hash) % 64))) != 0 &&
+	    (bloom[PFS_BLOOM_BIT1(hash) / 64] &
+	    (1ULL << (PFS_BLOOM_BIT1(hash) % 64))) != 0);
+}
+
+struct pfs_node	*pfs_find_child	(struct pfs_node *, const char *, size_t,
+				 struct pfs_node **);
+
 /*
  * Vnode cache
  */
 void	 pfs_vncache_load	(void);
 void	 pfs_vncache_unload	(void);
+void	 pfs_vncache_create	(struct pfs_info *);
+void	 pfs_vncache_destroy	(struct pfs_info *);
 int	 pfs_vncache_alloc	(struct mount *, struct vnode **,
 				 struct pfs_node *, pid_t pid);
 int	 pfs_vncache_free	(struct vnode *);
+void	 pfs_vncache_prewarm	(struct mount *, struct pfs_node *);
+void	 pfs_vncache_unpin	(struct mount *);
+void	 pfs_vncache_shrink	(void);
 
 /*
  * File number bitmap
@@ -67,34 +67,23 @@
 
 #include "pseudofs.h"
 
-static struct pfs_node *
-pfs_nodecreate(struct vnode * lowervp)
-{
-	struct pfs_node * xp;
-
-	MALLOC(xp, struct pfs_node *, sizeof(struct pfs_node), M_TEMP, M_WAITOK | M_ZERO);
-	if (xp != NULL) {
-		if (lowervp) {
-			xp->pfs_lowervp  = lowervp;
-			xp->pfs_lowervid = vnode_vid(lowervp);
-		}
-	}
-	return xp;
-}
-
-/* assumption is that vnode has iocount on it after vnode create */
+/*
+ * assumption is that vnode has iocount on it after vnode create
+ *
+ * fsnode becomes the vnode's private data (v_data); the caller owns it
+ * and keeps its back pointer to the vnode, so nothing is allocated here.
+ *
+ * If *vpp is not NULL it is an empty vnode from vnode_create_empty(),
+ * which is initialized in place instead of creating a new one; either
+ * way it is released if this fails.
+ */
 int
 pfs_getnewvnode(
-	struct mount * mp, struct vnode * lowervp, struct vnode * dvp, struct vnode ** vpp, struct componentname * cnp, int root)
+	struct mount * mp, struct vnode * lowervp, struct vnode * dvp, struct vnode ** vpp, struct componentname * cnp, int root, void * fsnode)
 {
 	struct vnode_fsparam vnfs_param;
 	int error             = 0;
 	enum vtype type       = VDIR;
-	struct pfs_node * xp = pfs_nodecreate(lowervp);
-
-	if (xp == NULL) {
-		return ENOMEM;
-	}
 
 	if (lowervp) {
 		type = vnode_vtype(lowervp);
@@ -104,7 +93,7 @@ pfs_getnewvnode(
 	vnfs_param.vnfs_vtype      = type;
 	vnfs_param.vnfs_str        = "pfs";
 	vnfs_param.vnfs_dvp        = dvp;
-	vnfs_param.vnfs_fsnode     = (void *)xp;
+	vnfs_param.vnfs_fsnode     = fsnode;
 	vnfs_param.vnfs_vops       = pfs_vnodeop_p;
 	vnfs_param.vnfs_markroot   = root;
 	vnfs_param.vnfs_marksystem = 0;
@@ -113,13 +102,14 @@ pfs_getnewvnode(
 	vnfs_param.vnfs_cnp        = cnp;
 	vnfs_param.vnfs_flags      = VNFS_ADDFSREF;
 
-	error = vnode_create(VNCREATE_FLAVOR, VCREATESIZE, &vnfs_param, vpp);
+	if (*vpp != NULLVP)
+		error = vnode_initialize(VNCREATE_FLAVOR, VCREATESIZE,
+		    &vnfs_param, vpp);
+	else
+		error = vnode_create(VNCREATE_FLAVOR, VCREATESIZE,
+		    &vnfs_param, vpp);
 	if (error == 0) {
-		xp->pfs_vnode = *vpp;
-		xp->pfs_myvid = vnode_vid(*vpp);
 		vnode_settag(*vpp, VT_NULL);
-	} else {
-		FREE(xp, M_TEMP);
 	}
 	return error;
 }
@@ -33,6 +33,7 @@ __FBSDID("$FreeBSD$");
 
 #include <kern/locks.h>
 #include <libkern/libkern.h>
+#include <libkern/OSAtomic.h>
 #include <mach/mach_types.h>
 
 #include <sys/param.h>
@@ -85,23 +86,294 @@ pfs_alloc_node_flags(struct pfs_info *pi, const char *name, pfs_type_t type, int
 		return (NULL);
 	lck_mtx_init(pn->pn_mutex, NULL, LCK_SLEEP_DEFAULT | MTX_DUPOK);
 	strlcpy(pn->pn_name, name, sizeof pn->pn_name);
+	pn->pn_namehash = pfs_namehash(pn->pn_name, strlen(pn->pn_name));
 	pn->pn_type = type;
 	pn->pn_info = pi;
+	pn->pn_refs = 1;
 	return (pn);
 }
 
+/*
+ * Take a reference on a node on behalf of a vnode cache entry
+ */
+void
+pfs_node_hold(struct pfs_node *pn)
+{
+
+	OSIncrementAtomic(&pn->pn_refs);
+}
+
+/*
+ * Drop a reference on a node, and free it if that was the last one
+ */
+void
+pfs_node_rele(struct pfs_node *pn)
+{
+
+	if (OSDecrementAtomic(&pn->pn_refs) > 1)
+		return;
+	KASSERT(pn->pn_dead, ("%s(): last reference to live node %s",
+	    __func__, pn->pn_name));
+	lck_mtx_destroy(pn->pn_mutex, NULL);
+	FREE(pn, M_PFSNODES);
+}
+
 static struct pfs_node *
 pfs_alloc_node(struct pfs_info *pi, const char *name, pfs_type_t type)
 {
 	return (pfs_alloc_node_flags(pi, name, type, 0));
 }
 
+/*
+ * Link a node into a directory index
+ */
+static void
+pfs_index_insert(struct pfs_index *pix, struct pfs_node *pn)
+{
+	struct pfs_node **bucket;
+
+	bucket = &pix->pix_buckets[pn->pn_namehash & pix->pix_mask];
+	pn->pn_hashnext = *bucket;
+	*bucket = pn;
+	if (pn->pn_type == pfstype_procdir)
+		pix->pix_procdir = pn;
+}
+
+/*
+ * Unlink a node from a directory index
+ */
+static void
+pfs_index_remove(struct pfs_index *pix, struct pfs_node *pn)
+{
+	struct pfs_node **iter;
+
+	iter = &pix->pix_buckets[pn->pn_namehash & pix->pix_mask];
+	while (*iter != NULL) {
+		if (*iter == pn) {
+			*iter = pn->pn_hashnext;
+			break;
+		}
+		iter = &(*iter)->pn_hashnext;
+	}
+	pn->pn_hashnext = NULL;
+	if (pix->pix_procdir == pn)
+		pix->pix_procdir = NULL;
+}
+
+static void
+pfs_index_free(struct pfs_index *pix)
+{
+
+	FREE(pix->pix_buckets, M_PFSNODES);
+	FREE(pix, M_PFSNODES);
+}
+
+/*
+ * (Re)build the index of a directory with nbuckets buckets, a power of
+ * two.  Called with the directory's mutex held, so the allocation cannot
+ * sleep; if it fails, the directory keeps its current index, if any.
+ */
+static void
+pfs_index_build(struct pfs_node *pd, u_int nbuckets)
+{
+	struct pfs_index *pix;
+	struct pfs_node *pn;
+
+	pfs_assert_owned(pd);
+	pix = malloc(sizeof *pix, M_PFSNODES, M_NOWAIT | M_ZERO);
+	if (pix == NULL)
+		return;
+	pix->pix_buckets = malloc(nbuckets * sizeof *pix->pix_buckets,
+	    M_PFSNODES, M_NOWAIT | M_ZERO);
+	if (pix->pix_buckets == NULL) {
+		FREE(pix, M_PFSNODES);
+		return;
+	}
+	pix->pix_mask = nbuckets - 1;
+	for (pn = pd->pn_nodes; pn != NULL; pn = pn->pn_next)
+		pfs_index_insert(pix, pn);
+	if (pd->pn_index != NULL)
+		pfs_index_free(pd->pn_index);
+	pd->pn_index = pix;
+}
+
+/*
+ * Fill in the name table entry of a node.  The prefix is zero padded, so
+ * a lookup key prepared the same way matches it exactly.
+ */
+static void
+pfs_nameent_set(struct pfs_nameent *pne, const char *name, size_t len,
+    uint32_t hash)
+{
+
+	bzero(pne->pne_prefix, sizeof pne->pne_prefix);
+	bcopy(name, pne->pne_prefix, MIN(len, PFS_NAMEPREFIX));
+	pne->pne_hash = hash;
+	pne->pne_len = len;
+}
+
+static void
+pfs_nametab_free(struct pfs_node *pd)
+{
+
+	if (pd->pn_names != NULL) {
+		FREE(pd->pn_names, M_PFSNODES);
+		pd->pn_names = NULL;
+	}
+}
+
+/*
+ * (Re)build the name table of a directory from its list of children.
+ * Called with the directory's mutex held; if the allocation fails, the
+ * directory goes without a table.
+ */
+static void
+pfs_nametab_build(struct pfs_node *pd, u_int size)
+{
+	struct pfs_nametab *pnt;
+	struct pfs_nameent *pne;
+	struct pfs_node *pn;
+
+	pfs_assert_owned(pd);
+	pfs_nametab_free(pd);
+	pnt = malloc(sizeof *pnt + size * sizeof *pne, M_PFSNODES,
+	    M_NOWAIT | M_ZERO);
+	if (pnt == NULL)
+		return;
+	pnt->pnt_size = size;
+	for (pn = pd->pn_nodes; pn != NULL; pn = pn->pn_next) {
+		KASSERT(pnt->pnt_count < size,
+		    ("%s(): name table too small", __func__));
+		pne = &pnt->pnt_ents[pnt->pnt_count++];
+		pfs_nameent_set(pne, pn->pn_name, strlen(pn->pn_name),
+		    pn->pn_namehash);
+		pne->pne_node = pn;
+		if (pn->pn_type == pfstype_procdir)
+			pnt->pnt_procdir = pn;
+	}
+	pd->pn_names = pnt;
+}
+
+/*
+ * Add a node, already on the list of children, to the name table
+ */
+static void
+pfs_nametab_add(struct pfs_node *pd, struct pfs_node *pn)
+{
+	struct pfs_nametab *pnt;
+	struct pfs_nameent *pne;
+
+	pnt = pd->pn_names;
+	if (pnt == NULL || pnt->pnt_count == pnt->pnt_size) {
+		pfs_nametab_build(pd, MAX(4, 2 * pd->pn_nchildren));
+		return;
+	}
+	pne = &pnt->pnt_ents[pnt->pnt_count++];
+	pfs_nameent_set(pne, pn->pn_name, strlen(pn->pn_name),
+	    pn->pn_namehash);
+	pne->pne_node = pn;
+	if (pn->pn_type == pfstype_procdir)
+		pnt->pnt_procdir = pn;
+}
+
+/*
+ * Remove a node from the name table; the last entry fills the hole.
+ */
+static void
+pfs_nametab_remove(struct pfs_node *pd, struct pfs_node *pn)
+{
+	struct pfs_nametab *pnt;
+	u_int i;
+
+	pnt = pd->pn_names;
+	for (i = 0; i < pnt->pnt_count; i++) {
+		if (pnt->pnt_ents[i].pne_node == pn) {
+			pnt->pnt_ents[i] = pnt->pnt_ents[--pnt->pnt_count];
+			break;
+		}
+	}
+	if (pnt->pnt_procdir == pn)
+		pnt->pnt_procdir = NULL;
+}
+
+/*
+ * Scan a name table.  Candidates are filtered on hash, length and the
+ * whole prefix, compared a word at a time, before any node is touched.
+ */
+static struct pfs_node *
+pfs_nametab_find(struct pfs_nametab *pnt, const char *name, size_t namelen,
+    uint32_t hash)
+{
+	struct pfs_nameent key, *pne, *end;
+
+	pfs_nameent_set(&key, name, namelen, hash);
+	end = &pnt->pnt_ents[pnt->pnt_count];
+	for (pne = pnt->pnt_ents; pne < end; pne++) {
+		if (pne->pne_hash != hash || pne->pne_len != namelen ||
+		    ((pne->pne_prefix[0] ^ key.pne_prefix[0]) |
+		    (pne->pne_prefix[1] ^ key.pne_prefix[1])) != 0)
+			continue;
+		if (namelen <= PFS_NAMEPREFIX ||
+		    bcmp(name + PFS_NAMEPREFIX,
+		    pne->pne_node->pn_name + PFS_NAMEPREFIX,
+		    namelen - PFS_NAMEPREFIX) == 0)
+			return (pne->pne_node);
+	}
+	return (NULL);
+}
+
+/*
+ * Find the child of a directory called name, which is namelen bytes long
+ * and need not be terminated.  On a miss, the directory's procdir child,
+ * if it has one, is returned through pdnp.  The directory's mutex must be
+ * held.
+ */
+struct pfs_node *
+pfs_find_child(struct pfs_node *pd, const char *name, size_t namelen,
+    struct pfs_node **pdnp)
+{
+	struct pfs_node *pn, *pdn;
+	uint32_t hash;
+
+	pfs_assert_owned(pd);
+	pdn = NULL;
+	if (namelen >= PFS_NAMELEN) {
+		/* no such name, and no pid is that long */
+		pn = NULL;
+	} else if (pd->pn_index != NULL) {
+		hash = pfs_namehash(name, namelen);
+		pn = pd->pn_index->pix_buckets[hash & pd->pn_index->pix_mask];
+		for (; pn != NULL; pn = pn->pn_hashnext)
+			if (pn->pn_namehash == hash &&
+			    pn->pn_name[namelen] == '\0' &&
+			    bcmp(name, pn->pn_name, namelen) == 0)
+				break;
+		pdn = pd->pn_index->pix_procdir;
+	} else if (pd->pn_names != NULL) {
+		pn = pfs_nametab_find(pd->pn_names, name, namelen,
+		    pfs_namehash(name, namelen));
+		pdn = pd->pn_names->pnt_procdir;
+	} else {
+		for (pn = pd->pn_nodes; pn != NULL; pn = pn->pn_next) {
+			if (pn->pn_type == pfstype_procdir)
+				pdn = pn;
+			if (pn->pn_name[namelen] == '\0' &&
+			    bcmp(name, pn->pn_name, namelen) == 0)
+				break;
+		}
+	}
+	if (pdnp != NULL)
+		*pdnp = pdn;
+	return (pn);
+}
+
 /*
  * Add a node to a directory
  */
 static void
 pfs_add_node(struct pfs_node *parent, struct pfs_node *pn)
 {
+	struct pfs_index *pix;
 #ifdef INVARIANTS
 	struct pfs_node *iter;
 #endif
@@ -138,6 +410,9 @@ pfs_add_node(struct pfs_node *parent, struct pfs_node *pn)
 	pfs_lock(parent);
 	if ((parent->pn_flags & PFS_PROCDEP) != 0)
 		pn->pn_flags |= PFS_PROCDEP;
+	/* unlocked lookups must not see the node before its filter bits */
+	pfs_bloom_set(parent->pn_bloom, pn->pn_namehash);
+	OSMemoryBarrier();
 	if (parent->pn_nodes == NULL) {
 		KASSERT(parent->pn_last_node == NULL,
 		    ("%s(): pn_last_node not NULL", __func__));
@@ -151,9 +426,41 @@ pfs_add_node(struct pfs_node *parent, struct pfs_node *pn)
 		parent->pn_last_node->pn_next = pn;
 		parent->pn_last_node = pn;
 	}
+	parent->pn_nchildren++;
+	pix = parent->pn_index;
+	if (pix != NULL) {
+		pfs_index_insert(pix, pn);
+		if (parent->pn_nchildren > 2 * (pix->pix_mask + 1))
+			pfs_index_build(parent, 2 * (pix->pix_mask + 1));
+	} else {
+		if (parent->pn_nchildren >= PFS_INDEX_MIN)
+			pfs_index_build(parent, PFS_INDEX_MIN);
+		if (parent->pn_index != NULL)
+			pfs_nametab_free(parent);
+		else
+			pfs_nametab_add(parent, pn);
+	}
 	pfs_unlock(parent);
 }
 
+/*
+ * Recompute the name filter of a directory from its children
+ */
+static void
+pfs_bloom_rebuild(struct pfs_node *pd)
+{
+	uint64_t bloom[PFS_BLOOM_BITS / 64];
+	struct pfs_node *pn;
+	u_int i;
+
+	pfs_assert_owned(pd);
+	bzero(bloom, sizeof bloom);
+	for (pn = pd->pn_nodes; pn != NULL; pn = pn->pn_next)
+		pfs_bloom_set(bloom, pn->pn_namehash);
+	for (i = 0; i < PFS_BLOOM_BITS / 64; i++)
+		pd->pn_bloom[i] = bloom[i];
+}
+
 /*
  * Detach a node from its aprent
  */
@@ -186,6 +493,13 @@ pfs_detach_node(struct pfs_node *pn)
 		}
 		iter = &(*iter)->pn_next;
 	}
+	if (parent->pn_index != NULL)
+		pfs_index_remove(parent->pn_index, pn);
+	else if (parent->pn_names != NULL)
+		pfs_nametab_remove(parent, pn);
+	parent->pn_nchildren--;
+	if (parent->pn_index == NULL)
+		pfs_bloom_rebuild(parent);
 	pn->pn_parent = NULL;
 	pfs_unlock(parent);
 }
@@ -299,11 +613,13 @@ struct pfs_node *
 pfs_find_node(struct pfs_node *parent, const char *name)
 {
 	struct pfs_node *pn;
+	size_t namelen;
 
+	namelen = strlen(name);
+	if (!pfs_bloom_test(parent, pfs_namehash(name, namelen)))
+		return (NULL);
 	pfs_lock(parent);
-	for (pn = parent->pn_nodes; pn != NULL; pn = pn->pn_next)
-		if (strcmp(pn->pn_name, name) == 0)
-			break;
+	pn = pfs_find_child(parent, name, namelen, NULL);
 	pfs_unlock(parent);
 	return (pn);
 }
@@ -330,9 +646,16 @@ pfs_destroy(struct pfs_node *pn)
 	    pn->pn_type == pfstype_procdir ||
 	    pn->pn_type == pfstype_root) {
 		pfs_lock(pn);
+		/* lookups fall back to the list, which is emptied below */
+		if (pn->pn_index != NULL) {
+			pfs_index_free(pn->pn_index);
+			pn->pn_index = NULL;
+		}
+		pfs_nametab_free(pn);
 		while (pn->pn_nodes != NULL) {
 			iter = pn->pn_nodes;
 			pn->pn_nodes = iter->pn_next;
+			pn->pn_nchildren--;
 			iter->pn_parent = NULL;
 			pfs_unlock(pn);
 			pfs_destroy(iter);
@@ -341,17 +664,24 @@ pfs_destroy(struct pfs_node *pn)
 		pfs_unlock(pn);
 	}
 
-	/* revoke vnodes and fileno */
+	/* no new vnodes from here on; revoke the cached ones and fileno */
+	pfs_lock(pn);
+	pn->pn_dead = 1;
+	pfs_unlock(pn);
 	pfs_purge(pn);
+	KASSERT(LIST_EMPTY(&pn->pn_vdata),
+	    ("%s(): node still has cached vnodes", __func__));
 
 	/* callback to free any private resources */
 	if (pn->pn_destroy != NULL)
 		pn_destroy(pn);
 
-	/* destroy the node */
+	/*
+	 * Destroy the node.  Vnodes still waiting to be reclaimed hold
+	 * references of their own, and the last one to go frees it.
+	 */
 	pfs_fileno_free(pn);
-	lck_mtx_destroy(pn->pn_mutex, NULL);
-	FREE(pn, M_PFSNODES);
+	pfs_node_rele(pn);
 
 	return (0);
 }
@@ -389,6 +719,7 @@ pfs_mount(struct pfs_info *pi, struct mount *mp)
 	sbp->f_files = 1;
 	sbp->f_ffree = 0;
 
+	pfs_vncache_prewarm(mp, pi->pi_root);
 	return (0);
 }
 
@@ -420,7 +751,14 @@ pfs_unmount(struct mount *mp, int mntflags)
 {
 	int error;
 
+	/* the pins are use references, which would keep vflush() busy */
+	pfs_vncache_unpin(mp);
 	error = vflush(mp, 0, (mntflags & MNT_FORCE) ?  FORCECLOSE : 0);
+	if (error != 0) {
+		/* still mounted; pin the static vnodes again */
+		pfs_vncache_prewarm(mp,
+		    ((struct pfs_info *)mp->mnt_data)->pi_root);
+	}
 	return (error);
 }
 
@@ -456,6 +794,7 @@ pfs_init(struct pfs_info *pi, struct vfsconf *vfc)
 	int error;
 
 	pfs_fileno_init(pi);
+	pfs_vncache_create(pi);
 
 	/* set up the root directory */
 	root = pfs_alloc_node(pi, "/", pfstype_root);
@@ -468,6 +807,8 @@ pfs_init(struct pfs_info *pi, struct vfsconf *vfc)
 	if (error) {
 		pfs_destroy(root);
 		pi->pi_root = NULL;
+		pfs_vncache_destroy(pi);
+		pfs_fileno_uninit(pi);
 		return (error);
 	}
 
@@ -486,6 +827,7 @@ pfs_uninit(struct pfs_info *pi, struct vfsconf *vfc)
 
 	pfs_destroy(pi->pi_root);
 	pi->pi_root = NULL;
+	pfs_vncache_destroy(pi);
 	pfs_fileno_uninit(pi);
 //	if (bootverbose)
 //		printf("%s unregistered\n", pi->pi_name);
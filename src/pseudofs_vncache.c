@@ -31,12 +31,16 @@
 #include <sys/cdefs.h>
 __FBSDID("$FreeBSD$");
 
+#include <kern/clock.h>
+#include <kern/cpu_number.h>
 #include <kern/locks.h>
+#include <kern/thread.h>
+#include <kern/thread_call.h>
+#include <libkern/OSAtomic.h>
 
 #include <sys/param.h>
 #include <sys/kernel.h>
 #include <sys/systm.h>
-#include <sys/eventhandler.h>
 #include <sys/lock.h>
 #include <sys/malloc.h>
 #include <sys/proc.h>
@@ -49,67 +53,1798 @@ __FBSDID("$FreeBSD$");
 
 static MALLOC_DEFINE(M_PFSVNCACHE, "pfs_vncache", "pseudofs vnode cache");
 
-static lck_mtx_t *pfs_vncache_mutex;
-static eventhandler_tag pfs_exit_tag;
-static void pfs_exit(void *arg, struct proc *p);
+static void pfs_exit(pid_t pid);
+static void pfs_exit_schedule(void);
+static void pfs_exit_sweep(thread_call_param_t, thread_call_param_t);
 static void pfs_purge_all(void);
+static void pfs_purge_cache(struct pfs_vncache *vc);
+static void pfs_purge_entry(struct pfs_vdata *pvd);
+static void pfs_purge_one(struct vnode *vnp);
+static void pfs_vncache_pool_drain(void);
+static void pfs_vncache_pool_fill(void);
+static void pfs_vncache_reclaim_start(void);
+static void pfs_vncache_reclaim_stop(void);
 
 static SYSCTL_NODE(_vfs_pfs, OID_AUTO, vncache, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
     "pseudofs vnode cache");
 
-static int pfs_vncache_entries;
-SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, entries, CTLFLAG_RD,
-    &pfs_vncache_entries, 0,
+/*
+ * Hit, miss and entry counts are kept per CPU, each CPU's counters on a
+ * cache line of their own, so that counting a hit never writes to a line
+ * shared with other CPUs.  A thread may migrate between picking its slot
+ * and updating it, so updates are still atomic, but the line is normally
+ * only ever touched by one CPU.  Readers sum the slots; the entry count of
+ * a single slot can go negative when entries are freed on another CPU
+ * than the one that created them.
+ *
+ * The same slots hold power-of-two histograms of the chain length seen by
+ * each insert, of the number of entries probed by each lookup, and of how
+ * long a chain lock is held, in nanoseconds.  Bucket 0 counts zeroes,
+ * bucket k values in [2^(k-1), 2^k), and the last bucket everything
+ * beyond.
+ */
+#define PFS_VNCACHE_NCPU	64
+#define PFS_VNCACHE_HISTSZ	20
+
+struct pfs_vncache_pcpu {
+	volatile SInt64	pc_hits;
+	volatile SInt64	pc_misses;
+	volatile SInt64	pc_entries;
+	volatile SInt64	pc_chainlen[PFS_VNCACHE_HISTSZ];
+	volatile SInt64	pc_probes[PFS_VNCACHE_HISTSZ];
+	volatile SInt64	pc_holdns[PFS_VNCACHE_HISTSZ];
+} __attribute__((aligned(64)));
+
+static struct pfs_vncache_pcpu pfs_vncache_pcpu[PFS_VNCACHE_NCPU];
+
+#define PFS_VNCACHE_COUNT(field, n)					\
+	OSAddAtomic64((n),						\
+	    &pfs_vncache_pcpu[cpu_number() & (PFS_VNCACHE_NCPU - 1)].field)
+
+static int64_t
+pfs_vncache_counter(size_t off)
+{
+	int64_t sum;
+	int i;
+
+	sum = 0;
+	for (i = 0; i < PFS_VNCACHE_NCPU; i++)
+		sum += *(volatile SInt64 *)((char *)&pfs_vncache_pcpu[i] + off);
+	return (sum);
+}
+
+#define PFS_VNCACHE_ENTRIES() \
+	pfs_vncache_counter(offsetof(struct pfs_vncache_pcpu, pc_entries))
+
+static __inline int
+pfs_vncache_bucket(uint64_t v)
+{
+	int b;
+
+	if (v == 0)
+		return (0);
+	b = 64 - __builtin_clzll(v);
+	return (MIN(b, PFS_VNCACHE_HISTSZ - 1));
+}
+
+#define PFS_VNCACHE_HIST(field, v) \
+	PFS_VNCACHE_COUNT(field[pfs_vncache_bucket(v)], 1)
+
+static int
+sysctl_pfs_vncache_counter(SYSCTL_HANDLER_ARGS)
+{
+	int64_t val;
+
+	val = pfs_vncache_counter((size_t)arg2);
+	return (SYSCTL_OUT(req, &val, sizeof val));
+}
+
+static int
+sysctl_pfs_vncache_hist(SYSCTL_HANDLER_ARGS)
+{
+	int64_t hist[PFS_VNCACHE_HISTSZ];
+	int b;
+
+	for (b = 0; b < PFS_VNCACHE_HISTSZ; b++)
+		hist[b] = pfs_vncache_counter((size_t)arg2 + b * sizeof(SInt64));
+	return (SYSCTL_OUT(req, hist, sizeof hist));
+}
+
+SYSCTL_PROC(_vfs_pfs_vncache, OID_AUTO, entries, CTLTYPE_QUAD | CTLFLAG_RD,
+    NULL, offsetof(struct pfs_vncache_pcpu, pc_entries),
+    sysctl_pfs_vncache_counter, "Q",
     "number of entries in the vnode cache");
 
-static int pfs_vncache_maxentries;
-SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, maxentries, CTLFLAG_RD,
-    &pfs_vncache_maxentries, 0,
-    "highest number of entries in the vnode cache");
+static int pfs_vncache_maxentries;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, maxentries, CTLFLAG_RW,
+    &pfs_vncache_maxentries, 0,
+    "maximum number of entries in the vnode cache (0 for no limit)");
+
+static int pfs_vncache_lowatentries;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, lowat_entries, CTLFLAG_RW,
+    &pfs_vncache_lowatentries, 0,
+    "number of entries the vnode cache is shrunk to under memory pressure");
+
+static int pfs_vncache_peakentries;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, peakentries, CTLFLAG_RD,
+    &pfs_vncache_peakentries, 0,
+    "highest number of entries in the vnode cache");
+
+SYSCTL_PROC(_vfs_pfs_vncache, OID_AUTO, hits, CTLTYPE_QUAD | CTLFLAG_RD,
+    NULL, offsetof(struct pfs_vncache_pcpu, pc_hits),
+    sysctl_pfs_vncache_counter, "Q",
+    "number of cache hits since initialization");
+
+SYSCTL_PROC(_vfs_pfs_vncache, OID_AUTO, misses, CTLTYPE_QUAD | CTLFLAG_RD,
+    NULL, offsetof(struct pfs_vncache_pcpu, pc_misses),
+    sysctl_pfs_vncache_counter, "Q",
+    "number of cache misses since initialization");
+
+SYSCTL_PROC(_vfs_pfs_vncache, OID_AUTO, chainlen_hist,
+    CTLTYPE_OPAQUE | CTLFLAG_RD, NULL,
+    offsetof(struct pfs_vncache_pcpu, pc_chainlen),
+    sysctl_pfs_vncache_hist, "Q",
+    "histogram of hash chain lengths at insert, in powers of two");
+
+SYSCTL_PROC(_vfs_pfs_vncache, OID_AUTO, probes_hist,
+    CTLTYPE_OPAQUE | CTLFLAG_RD, NULL,
+    offsetof(struct pfs_vncache_pcpu, pc_probes),
+    sysctl_pfs_vncache_hist, "Q",
+    "histogram of entries probed per lookup, in powers of two");
+
+SYSCTL_PROC(_vfs_pfs_vncache, OID_AUTO, holdtime_hist,
+    CTLTYPE_OPAQUE | CTLFLAG_RD, NULL,
+    offsetof(struct pfs_vncache_pcpu, pc_holdns),
+    sysctl_pfs_vncache_hist, "Q",
+    "histogram of chain lock hold times in ns, in powers of two");
+
+static int pfs_vncache_evictions;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, evictions, CTLFLAG_RD,
+    &pfs_vncache_evictions, 0,
+    "number of idle vnodes evicted to stay under maxentries");
+
+static int pfs_vncache_evictbusy;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, evictbusy, CTLFLAG_RD,
+    &pfs_vncache_evictbusy, 0,
+    "number of eviction candidates skipped because they were in use");
+
+//extern struct vop_vector pfs_vnodeops;	/* XXX -> .h file */
+
+/*
+ * Every pfs_info has a cache instance of its own, with its own hash table,
+ * chain locks and statistics, so that file systems do not contend with or
+ * slow down each other, and pfs_vncache_destroy() only has to visit the
+ * entries of one file system.  The pid records, the eviction ring, the
+ * reclaim worker and the object cache are shared by all instances.
+ *
+ * The hash table is resized online as the number of entries changes.  A
+ * resize installs a new table and then drains the old one a few chains at
+ * a time: every cache operation migrates PFS_VNCACHE_MIGRATE chains, and
+ * lookups consult both tables until the old one is empty.  The table
+ * pointers are protected by vc_tbllock, held shared by every operation
+ * and exclusive only to install or retire a table.
+ *
+ * Hash chains are protected by a fixed array of striped locks rather than
+ * a single mutex, so that lookups for unrelated entries do not contend.  The
+ * stripe is chosen by the low bits of the hash value, and since no table is
+ * ever smaller than PFS_VNCACHE_NLOCKS chains, an entry's stripe is the same
+ * in the current and the old table.  No code path ever holds more than one
+ * stripe at a time.
+ *
+ * Each stripe also has a sequence number, bumped under the stripe lock
+ * whenever an entry is linked into one of its chains, in either table.
+ * An inserter that saw a miss under the lock can skip the second search
+ * for a racing insert if the sequence has not moved since.
+ *
+ * Lock order: node mutex, then vc_tbllock, then a stripe lock, then a pid
+ * stripe lock, then pfs_vncache_clocklock, pfs_vncache_reclaimlock,
+ * pfs_vncache_poollock or pfs_vncache_pinlock.
+ *
+ * Lookups that hit do not take any of these locks; see
+ * pfs_vncache_lookup().  Writers therefore publish new chain links with
+ * a barrier, and entries and retired tables are only freed once every
+ * lock-free reader that might still see them has left.
+ */
+#define PFS_VNCACHE_NLOCKS	64
+
+SLIST_HEAD(pfs_vncache_head, pfs_vdata);
+
+struct pfs_vncache {
+	struct pfs_vncache_head	*vc_hashtbl;
+	u_long			 vc_hash;
+	struct pfs_vncache_head	*vc_oldtbl;	/* being drained */
+	u_long			 vc_oldhash;
+	u_long			 vc_minhash;
+	volatile u_long		 vc_gen;	/* odd while tables change */
+	int			 vc_cursor;	/* next old chain to migrate */
+	int			 vc_moved;	/* old chains migrated so far */
+	lck_rw_t		*vc_tbllock;
+	lck_mtx_t		*vc_locks[PFS_VNCACHE_NLOCKS];
+	u_int			 vc_seq[PFS_VNCACHE_NLOCKS];
+	SInt32			 vc_entries;
+	SInt32			 vc_refs;	/* entries, plus the pfs_info's */
+	u_long			 vc_resizes;
+	struct pfs_info		*vc_info;
+	LIST_ENTRY(pfs_vncache)	 vc_link;
+};
+
+#define PFS_VNCACHE_HASH(vc, h)	(&(vc)->vc_hashtbl[(h) & (vc)->vc_hash])
+#define PFS_VNCACHE_OLDHASH(vc, h) \
+	(&(vc)->vc_oldtbl[(h) & (vc)->vc_oldhash])
+#define PFS_VNCACHE_CHAINLOCK(vc, i) \
+	((vc)->vc_locks[(i) & (PFS_VNCACHE_NLOCKS - 1)])
+#define PFS_VNCACHE_LOCK(vc, h)	PFS_VNCACHE_CHAINLOCK(vc, h)
+#define PFS_VNCACHE_SEQ(vc, h) \
+	((vc)->vc_seq[(h) & (PFS_VNCACHE_NLOCKS - 1)])
+
+#define PFS_VNCACHE_MIGRATE	4	/* chains migrated per operation */
+#define PFS_VNCACHE_MAXLOAD	2	/* grow above this many per chain */
+#define PFS_VNCACHE_MINLOAD	8	/* shrink below one per this many */
+
+static LIST_HEAD(, pfs_vncache) pfs_vncache_list;
+static lck_mtx_t *pfs_vncache_listlock;
+
+static u_long pfs_vncache_resizes;
+SYSCTL_ULONG(_vfs_pfs_vncache, OID_AUTO, resizes, CTLFLAG_RD,
+    &pfs_vncache_resizes, "number of times a hash table was resized");
+
+/*
+ * One line per instance: file system name, entries, chains, resizes.
+ */
+static int
+sysctl_pfs_vncache_instances(SYSCTL_HANDLER_ARGS)
+{
+	struct pfs_vncache *vc;
+	char line[PFS_FSNAMELEN + 64];
+	int error, len;
+
+	error = 0;
+	lck_mtx_lock(pfs_vncache_listlock);
+	LIST_FOREACH(vc, &pfs_vncache_list, vc_link) {
+		len = snprintf(line, sizeof line, "%s %d %lu %lu\n",
+		    vc->vc_info->pi_name, (int)vc->vc_entries,
+		    vc->vc_hash + 1, vc->vc_resizes);
+		error = SYSCTL_OUT(req, line, len);
+		if (error != 0)
+			break;
+	}
+	lck_mtx_unlock(pfs_vncache_listlock);
+	if (error == 0)
+		error = SYSCTL_OUT(req, "", 1);
+	return (error);
+}
+
+SYSCTL_PROC(_vfs_pfs_vncache, OID_AUTO, instances,
+    CTLTYPE_STRING | CTLFLAG_RD, NULL, 0, sysctl_pfs_vncache_instances, "A",
+    "per file system vnode caches: name, entries, chains, resizes");
+
+/*
+ * Per-pid records, hashed on the pid, each holding the list of that
+ * process' entries.  The table has a fixed size since there is at most
+ * one record per live process.  Records and their lists are protected by
+ * a second array of stripe locks, taken after all the locks above.  A
+ * record is freed when its list becomes empty, unless pfs_exit() has
+ * already taken it out of the table, in which case pfs_exit() frees it.
+ */
+struct pfs_vnpid {
+	LIST_ENTRY(pfs_vnpid)	 pp_link;
+	LIST_HEAD(, pfs_vdata)	 pp_vdata;
+	pid_t			 pp_pid;
+	int			 pp_hashed;
+};
+
+static LIST_HEAD(pfs_vnpid_head, pfs_vnpid) *pfs_vncache_pidtbl;
+static u_long pfs_vncache_pidhash;
+static lck_mtx_t *pfs_vncache_pidlocks[PFS_VNCACHE_NLOCKS];
+#define PFS_VNCACHE_PIDHASH(pid) \
+	(&pfs_vncache_pidtbl[(pid) & pfs_vncache_pidhash])
+#define PFS_VNCACHE_PIDLOCK(pid) \
+	(pfs_vncache_pidlocks[(pid) & (PFS_VNCACHE_NLOCKS - 1)])
+
+/*
+ * XNU has no process exit hook for kernel extensions.  Instead, a thread
+ * call sweeps the pid table every PFS_EXIT_INTERVAL seconds and runs
+ * pfs_exit() for every pid that proc_find() no longer knows, so the
+ * entries of a process outlive it by up to one interval.
+ */
+#define PFS_EXIT_INTERVAL	5	/* seconds between sweeps */
+#define PFS_EXIT_BATCH		32	/* pids checked per record chain */
+
+static thread_call_t pfs_exit_call;
+static int pfs_exit_stopping;
+
+/*
+ * Eviction ring
+ *
+ * Entries for a process sit on a single ring in insertion order, which
+ * the clock hand sweeps from the head whenever an insert takes the cache
+ * over pfs_vncache_maxentries.  A hit sets PVD_REFERENCED, which buys the
+ * entry one more trip around the ring.  Entries for the root and the rest
+ * of the static tree (pvd_pid == NO_PID) are never put on the ring, so
+ * they are never evicted.  The ring is protected by pfs_vncache_clocklock;
+ * PVD_CLOCK only changes under it.
+ */
+static TAILQ_HEAD(, pfs_vdata) pfs_vncache_clock;
+static int pfs_vncache_nclock;
+static lck_mtx_t *pfs_vncache_clocklock;
+
+#define PFS_VNCACHE_SCAN	64	/* max ring positions per sweep */
+#define PFS_VNCACHE_PERPROC	16	/* default maxentries per maxproc */
+
+/*
+ * Entries pinned by pfs_vncache_prewarm(); see "Prewarming" below.
+ */
+static LIST_HEAD(, pfs_vdata) pfs_vncache_pinned;
+static lck_mtx_t *pfs_vncache_pinlock;
+
+/*
+ * Vnode pool lock and refill request; see "Vnode pool" below.
+ */
+static lck_mtx_t *pfs_vncache_poollock;
+static int pfs_vncache_poolwant;	/* under pfs_vncache_reclaimlock */
+
+/*
+ * Object cache for struct pfs_vdata
+ *
+ * Every miss allocates an entry and every reclaim frees one, so entries
+ * are recycled through per-CPU magazines backed by a global depot, after
+ * Bonwick's magazine allocator.  Each CPU slot holds a loaded and a
+ * previous magazine and only visits the depot to trade a whole magazine
+ * when both are empty (on allocation) or full (on free).  Only when the
+ * depot has no full magazine either does an allocation reach malloc().
+ * The depot keeps at most PFS_VDCACHE_DEPOTMAX full magazines; beyond
+ * that, freed objects go back to the system, so a burst of reclaims does
+ * not pin its peak footprint for the lifetime of the module.
+ */
+#define PFS_VDCACHE_NCPU	64
+#define PFS_VDMAG_SIZE		15
+#define PFS_VDCACHE_DEPOTMAX	64
+
+struct pfs_vdmag {
+	SLIST_ENTRY(pfs_vdmag)	 vm_link;
+	int			 vm_count;
+	struct pfs_vdata	*vm_objs[PFS_VDMAG_SIZE];
+};
+SLIST_HEAD(pfs_vdmag_list, pfs_vdmag);
+
+struct pfs_vdcpu {
+	lck_mtx_t		*vc_lock;
+	struct pfs_vdmag	*vc_loaded;
+	struct pfs_vdmag	*vc_prev;
+	uint64_t		 vc_hits;	/* (c) served from a magazine */
+	uint64_t		 vc_misses;	/* (c) served by malloc() */
+} __attribute__((aligned(64)));
+
+static struct pfs_vdcpu pfs_vdcache_cpu[PFS_VDCACHE_NCPU];
+static lck_mtx_t *pfs_vdcache_depotlock;
+static struct pfs_vdmag_list pfs_vdcache_full;		/* (d) */
+static struct pfs_vdmag_list pfs_vdcache_empty;		/* (d) */
+static int pfs_vdcache_nfull;				/* (d) */
+static SInt32 pfs_vdcache_nobjs;	/* objects obtained from malloc() */
+static SInt32 pfs_vdcache_nmags;	/* magazines obtained from malloc() */
+
+#define PFS_VDCACHE_CPU() \
+	(&pfs_vdcache_cpu[cpu_number() & (PFS_VDCACHE_NCPU - 1)])
+
+static int
+sysctl_pfs_vdcache(SYSCTL_HANDLER_ARGS)
+{
+	uint64_t val;
+	int i;
+
+	val = 0;
+	switch (arg2) {
+	case 0:
+		for (i = 0; i < PFS_VDCACHE_NCPU; i++)
+			val += pfs_vdcache_cpu[i].vc_hits;
+		break;
+	case 1:
+		for (i = 0; i < PFS_VDCACHE_NCPU; i++)
+			val += pfs_vdcache_cpu[i].vc_misses;
+		break;
+	case 2:
+		val = (uint64_t)pfs_vdcache_nobjs * sizeof(struct pfs_vdata) +
+		    (uint64_t)pfs_vdcache_nmags * sizeof(struct pfs_vdmag);
+		break;
+	}
+	return (SYSCTL_OUT(req, &val, sizeof val));
+}
+
+SYSCTL_PROC(_vfs_pfs_vncache, OID_AUTO, vdata_hits,
+    CTLTYPE_QUAD | CTLFLAG_RD, NULL, 0, sysctl_pfs_vdcache, "Q",
+    "number of vnode data allocations served from the object cache");
+SYSCTL_PROC(_vfs_pfs_vncache, OID_AUTO, vdata_misses,
+    CTLTYPE_QUAD | CTLFLAG_RD, NULL, 1, sysctl_pfs_vdcache, "Q",
+    "number of vnode data allocations that fell through to malloc");
+SYSCTL_PROC(_vfs_pfs_vncache, OID_AUTO, vdata_bytes,
+    CTLTYPE_QUAD | CTLFLAG_RD, NULL, 2, sysctl_pfs_vdcache, "Q",
+    "memory held by vnode data, in use or cached");
+
+static struct pfs_vdata *
+pfs_vdata_alloc(void)
+{
+	struct pfs_vdcpu *vc;
+	struct pfs_vdmag *mag, *full;
+	struct pfs_vdata *pvd;
+
+	vc = PFS_VDCACHE_CPU();
+	lck_mtx_lock(vc->vc_lock);
+	for (;;) {
+		mag = vc->vc_loaded;
+		if (mag != NULL && mag->vm_count > 0) {
+			pvd = mag->vm_objs[--mag->vm_count];
+			vc->vc_hits++;
+			lck_mtx_unlock(vc->vc_lock);
+			return (pvd);
+		}
+		if (vc->vc_prev != NULL && vc->vc_prev->vm_count > 0) {
+			vc->vc_loaded = vc->vc_prev;
+			vc->vc_prev = mag;
+			continue;
+		}
+		/* both empty: trade the loaded magazine for a full one */
+		lck_mtx_lock(pfs_vdcache_depotlock);
+		full = SLIST_FIRST(&pfs_vdcache_full);
+		if (full == NULL) {
+			lck_mtx_unlock(pfs_vdcache_depotlock);
+			break;
+		}
+		SLIST_REMOVE_HEAD(&pfs_vdcache_full, vm_link);
+		pfs_vdcache_nfull--;
+		if (mag != NULL)
+			SLIST_INSERT_HEAD(&pfs_vdcache_empty, mag, vm_link);
+		lck_mtx_unlock(pfs_vdcache_depotlock);
+		vc->vc_loaded = full;
+	}
+	vc->vc_misses++;
+	lck_mtx_unlock(vc->vc_lock);
+	pvd = malloc(sizeof *pvd, M_PFSVNCACHE, M_WAITOK);
+	OSIncrementAtomic(&pfs_vdcache_nobjs);
+	return (pvd);
+}
+
+static void
+pfs_vdata_free(struct pfs_vdata *pvd)
+{
+	struct pfs_vdcpu *vc;
+	struct pfs_vdmag *mag, *empty;
+
+	vc = PFS_VDCACHE_CPU();
+	lck_mtx_lock(vc->vc_lock);
+	for (;;) {
+		mag = vc->vc_loaded;
+		if (mag != NULL && mag->vm_count < PFS_VDMAG_SIZE) {
+			mag->vm_objs[mag->vm_count++] = pvd;
+			lck_mtx_unlock(vc->vc_lock);
+			return;
+		}
+		if (vc->vc_prev != NULL &&
+		    vc->vc_prev->vm_count < PFS_VDMAG_SIZE) {
+			vc->vc_loaded = vc->vc_prev;
+			vc->vc_prev = mag;
+			continue;
+		}
+		/* both full: trade the loaded magazine for an empty one */
+		lck_mtx_lock(pfs_vdcache_depotlock);
+		if (mag != NULL && pfs_vdcache_nfull >= PFS_VDCACHE_DEPOTMAX) {
+			/* the depot is full too; give the object back */
+			lck_mtx_unlock(pfs_vdcache_depotlock);
+			lck_mtx_unlock(vc->vc_lock);
+			FREE(pvd, M_PFSVNCACHE);
+			OSDecrementAtomic(&pfs_vdcache_nobjs);
+			return;
+		}
+		empty = SLIST_FIRST(&pfs_vdcache_empty);
+		if (empty != NULL) {
+			SLIST_REMOVE_HEAD(&pfs_vdcache_empty, vm_link);
+			if (mag != NULL) {
+				SLIST_INSERT_HEAD(&pfs_vdcache_full, mag,
+				    vm_link);
+				pfs_vdcache_nfull++;
+			}
+			lck_mtx_unlock(pfs_vdcache_depotlock);
+			vc->vc_loaded = empty;
+			continue;
+		}
+		lck_mtx_unlock(pfs_vdcache_depotlock);
+		/* grow the depot by one magazine and try again */
+		lck_mtx_unlock(vc->vc_lock);
+		empty = malloc(sizeof *empty, M_PFSVNCACHE, M_WAITOK | M_ZERO);
+		OSIncrementAtomic(&pfs_vdcache_nmags);
+		lck_mtx_lock(pfs_vdcache_depotlock);
+		SLIST_INSERT_HEAD(&pfs_vdcache_empty, empty, vm_link);
+		lck_mtx_unlock(pfs_vdcache_depotlock);
+		lck_mtx_lock(vc->vc_lock);
+	}
+}
+
+static void
+pfs_vdmag_destroy(struct pfs_vdmag *mag)
+{
+
+	while (mag->vm_count > 0) {
+		FREE(mag->vm_objs[--mag->vm_count], M_PFSVNCACHE);
+		OSDecrementAtomic(&pfs_vdcache_nobjs);
+	}
+	FREE(mag, M_PFSVNCACHE);
+	OSDecrementAtomic(&pfs_vdcache_nmags);
+}
+
+static void
+pfs_vdcache_init(void)
+{
+	int i;
+
+	for (i = 0; i < PFS_VDCACHE_NCPU; i++)
+		lck_mtx_init(pfs_vdcache_cpu[i].vc_lock, NULL,
+		    LCK_SLEEP_DEFAULT);
+	lck_mtx_init(pfs_vdcache_depotlock, NULL, LCK_SLEEP_DEFAULT);
+	SLIST_INIT(&pfs_vdcache_full);
+	SLIST_INIT(&pfs_vdcache_empty);
+	pfs_vdcache_nfull = 0;
+}
+
+static void
+pfs_vdcache_uninit(void)
+{
+	struct pfs_vdcpu *vc;
+	struct pfs_vdmag *mag;
+	int i;
+
+	for (i = 0; i < PFS_VDCACHE_NCPU; i++) {
+		vc = &pfs_vdcache_cpu[i];
+		if (vc->vc_loaded != NULL)
+			pfs_vdmag_destroy(vc->vc_loaded);
+		if (vc->vc_prev != NULL)
+			pfs_vdmag_destroy(vc->vc_prev);
+		vc->vc_loaded = vc->vc_prev = NULL;
+		lck_mtx_destroy(vc->vc_lock, NULL);
+	}
+	while ((mag = SLIST_FIRST(&pfs_vdcache_full)) != NULL) {
+		SLIST_REMOVE_HEAD(&pfs_vdcache_full, vm_link);
+		pfs_vdmag_destroy(mag);
+	}
+	while ((mag = SLIST_FIRST(&pfs_vdcache_empty)) != NULL) {
+		SLIST_REMOVE_HEAD(&pfs_vdcache_empty, vm_link);
+		pfs_vdmag_destroy(mag);
+	}
+	KASSERT(pfs_vdcache_nobjs == 0,
+	    ("%d vnode data objects leaked", (int)pfs_vdcache_nobjs));
+	lck_mtx_destroy(pfs_vdcache_depotlock, NULL);
+}
+
+/*
+ * Give cached objects back to the system until no more than lowat remain
+ * in the depot.  The spare magazine of each CPU is returned to the depot
+ * first, so that only the loaded magazines keep objects back; every empty
+ * magazine is freed too.  Returns the number of bytes released.
+ */
+static uint64_t
+pfs_vdcache_shrink(int lowat)
+{
+	struct pfs_vdmag_list reap;
+	struct pfs_vdcpu *vc;
+	struct pfs_vdmag *mag;
+	uint64_t bytes;
+	int cached, i;
+
+	for (i = 0; i < PFS_VDCACHE_NCPU; i++) {
+		vc = &pfs_vdcache_cpu[i];
+		lck_mtx_lock(vc->vc_lock);
+		mag = vc->vc_prev;
+		vc->vc_prev = NULL;
+		if (mag != NULL) {
+			lck_mtx_lock(pfs_vdcache_depotlock);
+			if (mag->vm_count > 0)
+				SLIST_INSERT_HEAD(&pfs_vdcache_full, mag,
+				    vm_link);
+			else
+				SLIST_INSERT_HEAD(&pfs_vdcache_empty, mag,
+				    vm_link);
+			lck_mtx_unlock(pfs_vdcache_depotlock);
+		}
+		lck_mtx_unlock(vc->vc_lock);
+	}
+
+	SLIST_INIT(&reap);
+	lck_mtx_lock(pfs_vdcache_depotlock);
+	cached = 0;
+	SLIST_FOREACH(mag, &pfs_vdcache_full, vm_link)
+		cached += mag->vm_count;
+	while (cached > lowat &&
+	    (mag = SLIST_FIRST(&pfs_vdcache_full)) != NULL) {
+		SLIST_REMOVE_HEAD(&pfs_vdcache_full, vm_link);
+		cached -= mag->vm_count;
+		SLIST_INSERT_HEAD(&reap, mag, vm_link);
+	}
+	while ((mag = SLIST_FIRST(&pfs_vdcache_empty)) != NULL) {
+		SLIST_REMOVE_HEAD(&pfs_vdcache_empty, vm_link);
+		SLIST_INSERT_HEAD(&reap, mag, vm_link);
+	}
+	lck_mtx_unlock(pfs_vdcache_depotlock);
+
+	bytes = 0;
+	while ((mag = SLIST_FIRST(&reap)) != NULL) {
+		SLIST_REMOVE_HEAD(&reap, vm_link);
+		bytes += (uint64_t)mag->vm_count * sizeof(struct pfs_vdata) +
+		    sizeof *mag;
+		pfs_vdmag_destroy(mag);
+	}
+	return (bytes);
+}
+
+/*
+ * Read-side critical sections for lock-free lookups.
+ *
+ * A reader announces itself by bumping the counter for the current epoch
+ * parity in its CPU's slot, and then checks that the epoch did not flip
+ * underneath it.  pfs_vncache_synchronize() flips the epoch and waits for
+ * the counters of the previous parity to drain, after which no reader can
+ * hold a pointer to anything unlinked before the flip.  Readers may be
+ * preempted and migrated; they always drop the counter they bumped.
+ *
+ * Freed entries are parked on a limbo list and released in batches of
+ * PFS_VNCACHE_LIMBO, so the cost of a grace period is amortized.
+ */
+#define PFS_VNCACHE_NSLOTS	64
+#define PFS_VNCACHE_LIMBO	64
+
+struct pfs_vncache_rdslot {
+	volatile SInt32		 rs_count[2];
+} __attribute__((aligned(64)));
+
+static struct pfs_vncache_rdslot pfs_vncache_readers[PFS_VNCACHE_NSLOTS];
+static volatile SInt32 pfs_vncache_epoch;
+static lck_mtx_t *pfs_vncache_synclock;
+static lck_mtx_t *pfs_vncache_limbolock;
+static SLIST_HEAD(, pfs_vdata) pfs_vncache_limbo;
+static int pfs_vncache_nlimbo;
+
+static __inline int
+pfs_vncache_read_enter(void)
+{
+	int e, slot;
+
+	slot = cpu_number() & (PFS_VNCACHE_NSLOTS - 1);
+	for (;;) {
+		e = pfs_vncache_epoch & 1;
+		OSIncrementAtomic(&pfs_vncache_readers[slot].rs_count[e]);
+		OSMemoryBarrier();
+		if ((pfs_vncache_epoch & 1) == e)
+			return ((slot << 1) | e);
+		OSDecrementAtomic(&pfs_vncache_readers[slot].rs_count[e]);
+	}
+}
+
+static __inline void
+pfs_vncache_read_exit(int token)
+{
+
+	OSMemoryBarrier();
+	OSDecrementAtomic(
+	    &pfs_vncache_readers[token >> 1].rs_count[token & 1]);
+}
+
+/*
+ * Wait until every reader that entered before the call has left.  May
+ * sleep; must be called without any cache lock held.
+ */
+static void
+pfs_vncache_synchronize(void)
+{
+	SInt32 n;
+	int e, i;
+
+	lck_mtx_lock(pfs_vncache_synclock);
+	OSMemoryBarrier();
+	e = pfs_vncache_epoch & 1;
+	OSIncrementAtomic(&pfs_vncache_epoch);
+	OSMemoryBarrier();
+	for (;;) {
+		for (n = 0, i = 0; i < PFS_VNCACHE_NSLOTS; i++)
+			n += pfs_vncache_readers[i].rs_count[e];
+		if (n == 0)
+			break;
+		delay(1);
+	}
+	lck_mtx_unlock(pfs_vncache_synclock);
+}
+
+/*
+ * Free everything on the limbo list after a grace period.
+ */
+static void
+pfs_vncache_reap(void)
+{
+	SLIST_HEAD(, pfs_vdata) reap;
+	struct pfs_vdata *pvd;
+
+	lck_mtx_lock(pfs_vncache_limbolock);
+	reap.slh_first = SLIST_FIRST(&pfs_vncache_limbo);
+	SLIST_INIT(&pfs_vncache_limbo);
+	pfs_vncache_nlimbo = 0;
+	lck_mtx_unlock(pfs_vncache_limbolock);
+	if (SLIST_EMPTY(&reap))
+		return;
+	pfs_vncache_synchronize();
+	while ((pvd = SLIST_FIRST(&reap)) != NULL) {
+		SLIST_REMOVE_HEAD(&reap, pvd_limbo);
+		pfs_vdata_free(pvd);
+	}
+}
+
+/*
+ * Hand an unlinked entry over for deferred freeing.
+ */
+static void
+pfs_vncache_retire(struct pfs_vdata *pvd)
+{
+	int n;
+
+	lck_mtx_lock(pfs_vncache_limbolock);
+	SLIST_INSERT_HEAD(&pfs_vncache_limbo, pvd, pvd_limbo);
+	n = ++pfs_vncache_nlimbo;
+	lck_mtx_unlock(pfs_vncache_limbolock);
+	if (n >= PFS_VNCACHE_LIMBO)
+		pfs_vncache_reap();
+}
+
+/*
+ * Link an entry at the head of a chain so that a lock-free reader either
+ * does not see it or sees it fully initialized.  Called with the chain's
+ * stripe lock held.
+ */
+static __inline void
+pfs_vncache_publish(struct pfs_vncache_head *head, struct pfs_vdata *pvd)
+{
+
+	pvd->pvd_hash.sle_next = SLIST_FIRST(head);
+	OSMemoryBarrier();
+	SLIST_FIRST(head) = pvd;
+	PFS_VNCACHE_SEQ(pvd->pvd_cache, pvd->pvd_hashval)++;
+}
+
+/*
+ * Entries are keyed on the full (node, pid, mount) tuple.  Hashing on the
+ * pid alone put every node of a process, and every static node of every
+ * mount, on the same chain.  The key is run through a 64-bit finalizer so
+ * that the low bits used to pick a chain depend on all of it.
+ */
+static __inline uint64_t
+pfs_vncache_mix(uint64_t h)
+{
+
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return (h ^ (h >> 31));
+}
+
+static __inline u_long
+pfs_vncache_hashval(struct pfs_node *pn, pid_t pid, struct mount *mp)
+{
+	uint64_t h;
+
+	h = pfs_vncache_mix((uintptr_t)pn ^ ((uint64_t)(uintptr_t)mp << 1));
+	return ((u_long)pfs_vncache_mix(h + (uint32_t)pid));
+}
+
+/*
+ * Initialize vnode cache
+ */
+void
+pfs_vncache_load(void)
+{
+	int i;
+
+	for (i = 0; i < PFS_VNCACHE_NLOCKS; i++)
+		lck_mtx_init(pfs_vncache_pidlocks[i], NULL, LCK_SLEEP_DEFAULT);
+	lck_mtx_init(pfs_vncache_listlock, NULL, LCK_SLEEP_DEFAULT);
+	LIST_INIT(&pfs_vncache_list);
+	pfs_vncache_pidtbl = hashinit(MAX(maxproc / 4, PFS_VNCACHE_NLOCKS),
+	    M_PFSVNCACHE, &pfs_vncache_pidhash);
+	lck_mtx_init(pfs_vncache_synclock, NULL, LCK_SLEEP_DEFAULT);
+	lck_mtx_init(pfs_vncache_limbolock, NULL, LCK_SLEEP_DEFAULT);
+	SLIST_INIT(&pfs_vncache_limbo);
+	lck_mtx_init(pfs_vncache_clocklock, NULL, LCK_SLEEP_DEFAULT);
+	TAILQ_INIT(&pfs_vncache_clock);
+	lck_mtx_init(pfs_vncache_pinlock, NULL, LCK_SLEEP_DEFAULT);
+	LIST_INIT(&pfs_vncache_pinned);
+	if (pfs_vncache_maxentries == 0)
+		pfs_vncache_maxentries = maxproc * PFS_VNCACHE_PERPROC;
+	if (pfs_vncache_lowatentries == 0)
+		pfs_vncache_lowatentries = pfs_vncache_maxentries / 4;
+	pfs_vdcache_init();
+	lck_mtx_init(pfs_vncache_poollock, NULL, LCK_SLEEP_DEFAULT);
+	pfs_vncache_reclaim_start();
+	pfs_exit_stopping = 0;
+	pfs_exit_call = thread_call_allocate(pfs_exit_sweep, NULL);
+	pfs_exit_schedule();
+}
+
+/*
+ * Tear down vnode cache
+ */
+void
+pfs_vncache_unload(void)
+{
+	int i;
+
+	/* a sweep in progress may rearm the call once more */
+	pfs_exit_stopping = 1;
+	thread_call_cancel_wait(pfs_exit_call);
+	thread_call_cancel_wait(pfs_exit_call);
+	thread_call_free(pfs_exit_call);
+	pfs_purge_all();
+	pfs_vncache_reclaim_stop();
+	pfs_vncache_pool_drain();
+	KASSERT(LIST_EMPTY(&pfs_vncache_list),
+	    ("vnode cache instances remaining"));
+	KASSERT(PFS_VNCACHE_ENTRIES() == 0,
+	    ("%lld vncache entries remaining",
+	    (long long)PFS_VNCACHE_ENTRIES()));
+	KASSERT(TAILQ_EMPTY(&pfs_vncache_clock),
+	    ("%d entries left on the eviction ring", pfs_vncache_nclock));
+	pfs_vncache_reap();
+	pfs_vdcache_uninit();
+	FREE(pfs_vncache_pidtbl, M_PFSVNCACHE);
+	pfs_vncache_pidtbl = NULL;
+	lck_mtx_destroy(pfs_vncache_listlock, NULL);
+	lck_mtx_destroy(pfs_vncache_pinlock, NULL);
+	lck_mtx_destroy(pfs_vncache_clocklock, NULL);
+	lck_mtx_destroy(pfs_vncache_limbolock, NULL);
+	lck_mtx_destroy(pfs_vncache_synclock, NULL);
+	for (i = 0; i < PFS_VNCACHE_NLOCKS; i++)
+		lck_mtx_destroy(pfs_vncache_pidlocks[i], NULL);
+}
+
+/*
+ * Set up the cache instance of a pseudofs file system
+ */
+void
+pfs_vncache_create(struct pfs_info *pi)
+{
+	struct pfs_vncache *vc;
+	int i;
+
+	vc = malloc(sizeof *vc, M_PFSVNCACHE, M_WAITOK | M_ZERO);
+	for (i = 0; i < PFS_VNCACHE_NLOCKS; i++)
+		lck_mtx_init(vc->vc_locks[i], NULL, LCK_SLEEP_DEFAULT);
+	lck_rw_init(vc->vc_tbllock, NULL, LCK_SLEEP_DEFAULT);
+	vc->vc_hashtbl = hashinit(MAX(maxproc / 4, PFS_VNCACHE_NLOCKS),
+	    M_PFSVNCACHE, &vc->vc_hash);
+	vc->vc_minhash = vc->vc_hash;
+	vc->vc_refs = 1;
+	vc->vc_info = pi;
+	pi->pi_vncache = vc;
+	lck_mtx_lock(pfs_vncache_listlock);
+	LIST_INSERT_HEAD(&pfs_vncache_list, vc, vc_link);
+	lck_mtx_unlock(pfs_vncache_listlock);
+}
+
+/*
+ * Take a reference on a cache instance on behalf of an entry
+ */
+static void
+pfs_vncache_hold(struct pfs_vncache *vc)
+{
+
+	OSIncrementAtomic(&vc->vc_refs);
+}
+
+/*
+ * Drop a reference on a cache instance, and free it if that was the last
+ * one
+ */
+static void
+pfs_vncache_rele(struct pfs_vncache *vc)
+{
+	int i;
+
+	if (OSDecrementAtomic(&vc->vc_refs) > 1)
+		return;
+	KASSERT(vc->vc_entries == 0,
+	    ("%d entries remaining in %s vnode cache", (int)vc->vc_entries,
+	    vc->vc_info->pi_name));
+	/* lock-free readers may still be walking the tables */
+	pfs_vncache_synchronize();
+	if (vc->vc_oldtbl != NULL)
+		FREE(vc->vc_oldtbl, M_PFSVNCACHE);
+	FREE(vc->vc_hashtbl, M_PFSVNCACHE);
+	lck_rw_destroy(vc->vc_tbllock, NULL);
+	for (i = 0; i < PFS_VNCACHE_NLOCKS; i++)
+		lck_mtx_destroy(vc->vc_locks[i], NULL);
+	FREE(vc, M_PFSVNCACHE);
+}
+
+/*
+ * Tear down the cache instance of a pseudofs file system.  Only this
+ * instance's entries are visited.  Vnodes still waiting to be reclaimed
+ * hold references of their own, and the last one to go frees the
+ * instance.
+ */
+void
+pfs_vncache_destroy(struct pfs_info *pi)
+{
+	struct pfs_vncache *vc;
+
+	vc = pi->pi_vncache;
+	lck_mtx_lock(pfs_vncache_listlock);
+	LIST_REMOVE(vc, vc_link);
+	lck_mtx_unlock(pfs_vncache_listlock);
+	pfs_purge_cache(vc);
+	pi->pi_vncache = NULL;
+	pfs_vncache_rele(vc);
+}
+
+/*
+ * Look up the record for a pid.  Called with the pid's stripe lock held.
+ */
+static struct pfs_vnpid *
+pfs_vncache_pidfind(pid_t pid)
+{
+	struct pfs_vnpid *pp;
+
+	LIST_FOREACH(pp, PFS_VNCACHE_PIDHASH(pid), pp_link) {
+		if (pp->pp_pid == pid)
+			return (pp);
+	}
+	return (NULL);
+}
+
+/*
+ * Take an entry off the list of its process' record, and free the record
+ * if that leaves it empty.  A record that pfs_exit() has taken out of the
+ * table is left for pfs_exit() to free.  The caller may hold any of the
+ * locks that come before the pid stripe locks.
+ */
+static void
+pfs_vncache_pidunlink(struct pfs_vdata *pvd)
+{
+	struct pfs_vnpid *pp;
+	lck_mtx_t *lock;
+
+	if (pvd->pvd_pid == NO_PID)
+		return;
+	pp = NULL;
+	lock = PFS_VNCACHE_PIDLOCK(pvd->pvd_pid);
+	lck_mtx_lock(lock);
+	if ((pvd->pvd_flags & PVD_PIDLIST) != 0) {
+		LIST_REMOVE(pvd, pvd_pidlink);
+		OSBitAndAtomic(~PVD_PIDLIST, &pvd->pvd_flags);
+		pp = pvd->pvd_pidrec;
+		if (LIST_EMPTY(&pp->pp_vdata) && pp->pp_hashed)
+			LIST_REMOVE(pp, pp_link);
+		else
+			pp = NULL;
+	}
+	lck_mtx_unlock(lock);
+	if (pp != NULL)
+		FREE(pp, M_PFSVNCACHE);
+}
+
+static __inline int
+pfs_vncache_match(struct pfs_vdata *pvd, u_long hashval, struct pfs_node *pn,
+		  pid_t pid, struct mount *mp)
+{
+
+	return (pvd->pvd_hashval == hashval && pvd->pvd_pn == pn &&
+	    pvd->pvd_pid == pid && pvd->pvd_vnode->v_mount == mp &&
+	    (pvd->pvd_flags & PVD_DEAD) == 0);
+}
+
+/*
+ * Take and release a chain lock on the lookup, insert and free paths,
+ * recording how long it was held.
+ */
+static __inline uint64_t
+pfs_vncache_chainlock(lck_mtx_t *lock)
+{
+
+	lck_mtx_lock(lock);
+	return (mach_absolute_time());
+}
+
+static __inline void
+pfs_vncache_chainunlock(lck_mtx_t *lock, uint64_t start)
+{
+	uint64_t ns;
+
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+	lck_mtx_unlock(lock);
+	PFS_VNCACHE_HIST(pc_holdns, ns);
+}
+
+/*
+ * Look up an entry in the current table and, while a resize is in
+ * progress, in the table being drained.  Called with the table lock held
+ * shared and the entry's stripe lock held.
+ */
+static struct pfs_vdata *
+pfs_vncache_find(struct pfs_vncache *vc, u_long hashval, struct pfs_node *pn,
+		 pid_t pid, struct mount *mp, int *probesp)
+{
+	struct pfs_vdata *pvd;
+
+	SLIST_FOREACH(pvd, PFS_VNCACHE_HASH(vc, hashval), pvd_hash) {
+		++*probesp;
+		if (pfs_vncache_match(pvd, hashval, pn, pid, mp))
+			return (pvd);
+	}
+	if (vc->vc_oldtbl == NULL)
+		return (NULL);
+	SLIST_FOREACH(pvd, PFS_VNCACHE_OLDHASH(vc, hashval), pvd_hash) {
+		++*probesp;
+		if (pfs_vncache_match(pvd, hashval, pn, pid, mp))
+			return (pvd);
+	}
+	return (NULL);
+}
+
+/*
+ * Lock-free lookup.  The table pointers are sampled under the generation
+ * count like a sequence lock, and chains are walked inside a read-side
+ * section, so neither an entry nor a table can be freed under us.  On a
+ * match, the vnode and its vid are returned for the caller to validate
+ * with vnode_getwithvid(), since the entry may die as soon as we leave.
+ *
+ * A miss is not authoritative: a chain being migrated by a resize can
+ * briefly hide entries from a lock-free walk, and callers must confirm
+ * it with pfs_vncache_find().  Both add the number of entries they
+ * looked at to *probesp.
+ */
+static int
+pfs_vncache_lookup(struct pfs_vncache *vc, u_long hashval,
+		   struct pfs_node *pn, pid_t pid, struct mount *mp,
+		   struct vnode **vpp, uint32_t *vidp, int *probesp)
+{
+	struct pfs_vncache_head *tbl, *oldtbl;
+	struct pfs_vdata *pvd;
+	u_long gen, hash, oldhash;
+	int found, token;
+
+	found = 0;
+	token = pfs_vncache_read_enter();
+	gen = vc->vc_gen;
+	OSMemoryBarrier();
+	tbl = vc->vc_hashtbl;
+	hash = vc->vc_hash;
+	oldtbl = vc->vc_oldtbl;
+	oldhash = vc->vc_oldhash;
+	OSMemoryBarrier();
+	if ((gen & 1) != 0 || gen != vc->vc_gen)
+		goto out;
+	SLIST_FOREACH(pvd, &tbl[hashval & hash], pvd_hash) {
+		++*probesp;
+		if (pfs_vncache_match(pvd, hashval, pn, pid, mp))
+			goto hit;
+	}
+	if (oldtbl == NULL)
+		goto out;
+	SLIST_FOREACH(pvd, &oldtbl[hashval & oldhash], pvd_hash) {
+		++*probesp;
+		if (pfs_vncache_match(pvd, hashval, pn, pid, mp))
+			goto hit;
+	}
+	goto out;
+hit:
+	if ((pvd->pvd_flags & PVD_REFERENCED) == 0)
+		OSBitOrAtomic(PVD_REFERENCED, &pvd->pvd_flags);
+	*vpp = pvd->pvd_vnode;
+	*vidp = pvd->pvd_vid;
+	found = 1;
+out:
+	pfs_vncache_read_exit(token);
+	return (found);
+}
+
+/*
+ * Remove an entry from whichever table holds it.  Same locking as
+ * pfs_vncache_find().  Returns non-zero if the entry was found.
+ */
+static int
+pfs_vncache_unlink(struct pfs_vdata *pvd)
+{
+	struct pfs_vncache *vc;
+	struct pfs_vncache_head *head;
+	struct pfs_vdata *pvd2;
+
+	vc = pvd->pvd_cache;
+	head = PFS_VNCACHE_HASH(vc, pvd->pvd_hashval);
+	SLIST_FOREACH(pvd2, head, pvd_hash) {
+		if (pvd2 != pvd)
+			continue;
+		SLIST_REMOVE(head, pvd, pfs_vdata, pvd_hash);
+		goto found;
+	}
+	if (vc->vc_oldtbl == NULL)
+		return (0);
+	head = PFS_VNCACHE_OLDHASH(vc, pvd->pvd_hashval);
+	SLIST_FOREACH(pvd2, head, pvd_hash) {
+		if (pvd2 != pvd)
+			continue;
+		SLIST_REMOVE(head, pvd, pfs_vdata, pvd_hash);
+		goto found;
+	}
+	return (0);
+found:
+	OSBitAndAtomic(~PVD_HASHED, &pvd->pvd_flags);
+	OSDecrementAtomic(&vc->vc_entries);
+	return (1);
+}
+
+/*
+ * Move up to PFS_VNCACHE_MIGRATE chains from the table being drained into
+ * the current one.  Called with the table lock held shared.  An old chain
+ * and all the new chains its entries hash to share one stripe lock.
+ */
+static void
+pfs_vncache_migrate(struct pfs_vncache *vc)
+{
+	struct pfs_vdata *pvd;
+	lck_mtx_t *lock;
+	u_long i;
+	int n;
+
+	if (vc->vc_oldtbl == NULL)
+		return;
+	for (n = 0; n < PFS_VNCACHE_MIGRATE; n++) {
+		i = (u_long)OSIncrementAtomic(&vc->vc_cursor);
+		if (i > vc->vc_oldhash)
+			break;
+		lock = PFS_VNCACHE_CHAINLOCK(vc, i);
+		lck_mtx_lock(lock);
+		while ((pvd = SLIST_FIRST(&vc->vc_oldtbl[i])) != NULL) {
+			SLIST_REMOVE_HEAD(&vc->vc_oldtbl[i], pvd_hash);
+			pfs_vncache_publish(
+			    PFS_VNCACHE_HASH(vc, pvd->pvd_hashval), pvd);
+		}
+		lck_mtx_unlock(lock);
+		OSIncrementAtomic(&vc->vc_moved);
+	}
+}
+
+/*
+ * Retire a fully drained table, or start a resize if the load factor has
+ * left the [1/PFS_VNCACHE_MINLOAD, PFS_VNCACHE_MAXLOAD] band.  Called
+ * without any cache lock held, as it may sleep allocating the new table.
+ */
+static void
+pfs_vncache_resize(struct pfs_vncache *vc)
+{
+	struct pfs_vncache_head *tbl;
+	u_long entries, hash, nchains, newhash;
+
+	if (vc->vc_oldtbl != NULL) {
+		if ((u_long)vc->vc_moved <= vc->vc_oldhash)
+			return;
+		lck_rw_lock_exclusive(vc->vc_tbllock);
+		tbl = vc->vc_oldtbl;
+		if (tbl != NULL && (u_long)vc->vc_moved > vc->vc_oldhash) {
+			vc->vc_gen++;
+			OSMemoryBarrier();
+			vc->vc_oldtbl = NULL;
+			OSMemoryBarrier();
+			vc->vc_gen++;
+		} else {
+			tbl = NULL;
+		}
+		lck_rw_unlock_exclusive(vc->vc_tbllock);
+		if (tbl != NULL) {
+			/* lock-free readers may still be walking it */
+			pfs_vncache_synchronize();
+			FREE(tbl, M_PFSVNCACHE);
+		}
+		return;
+	}
+
+	entries = (u_long)MAX(vc->vc_entries, 0);
+	hash = vc->vc_hash;
+	nchains = hash + 1;
+	if (entries > nchains * PFS_VNCACHE_MAXLOAD)
+		nchains *= 2;
+	else if (entries * PFS_VNCACHE_MINLOAD < nchains &&
+	    hash > vc->vc_minhash)
+		nchains /= 2;
+	else
+		return;
+
+	tbl = hashinit(nchains, M_PFSVNCACHE, &newhash);
+	lck_rw_lock_exclusive(vc->vc_tbllock);
+	if (vc->vc_oldtbl != NULL || vc->vc_hash != hash) {
+		/* somebody else got there first */
+		lck_rw_unlock_exclusive(vc->vc_tbllock);
+		FREE(tbl, M_PFSVNCACHE);
+		return;
+	}
+	vc->vc_gen++;
+	OSMemoryBarrier();
+	vc->vc_oldtbl = vc->vc_hashtbl;
+	vc->vc_oldhash = vc->vc_hash;
+	vc->vc_hashtbl = tbl;
+	vc->vc_hash = newhash;
+	vc->vc_cursor = 0;
+	vc->vc_moved = 0;
+	OSMemoryBarrier();
+	vc->vc_gen++;
+	vc->vc_resizes++;
+	lck_rw_unlock_exclusive(vc->vc_tbllock);
+	OSIncrementAtomicLong((volatile long *)&pfs_vncache_resizes);
+}
+
+/*
+ * Reclaim worker
+ *
+ * Purging only marks entries dead and puts them on the reclaim queue; the
+ * vnodes are revoked by a kernel thread, a batch at a time, so the thread
+ * destroying a node or handling a process exit does not pay for it.  An
+ * entry whose vnode is reclaimed some other way leaves the queue in
+ * pfs_vncache_free().  The queue, the worker state and the statistics are
+ * protected by pfs_vncache_reclaimlock, which is a leaf lock.
+ */
+static TAILQ_HEAD(, pfs_vdata) pfs_vncache_reclaimq;
+static lck_mtx_t *pfs_vncache_reclaimlock;
+static int pfs_vncache_reclaimbusy;	/* worker is revoking a batch */
+static int pfs_vncache_reclaimexit;	/* worker should exit */
+static int pfs_vncache_reclaimrunning;	/* worker has not exited yet */
+
+static int pfs_vncache_reclaimdepth;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, reclaim_depth, CTLFLAG_RD,
+    &pfs_vncache_reclaimdepth, 0,
+    "number of entries waiting on the reclaim queue");
+
+static int pfs_vncache_reclaimmaxdepth;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, reclaim_maxdepth, CTLFLAG_RD,
+    &pfs_vncache_reclaimmaxdepth, 0,
+    "highest number of entries on the reclaim queue");
+
+static uint64_t pfs_vncache_reclaimed;
+SYSCTL_QUAD(_vfs_pfs_vncache, OID_AUTO, reclaimed, CTLFLAG_RD,
+    &pfs_vncache_reclaimed,
+    "number of entries drained from the reclaim queue");
+
+static uint64_t pfs_vncache_reclaimns;
+SYSCTL_QUAD(_vfs_pfs_vncache, OID_AUTO, reclaim_latency, CTLFLAG_RD,
+    &pfs_vncache_reclaimns,
+    "total time entries spent on the reclaim queue, in ns");
+
+static uint64_t pfs_vncache_reclaimmaxns;
+SYSCTL_QUAD(_vfs_pfs_vncache, OID_AUTO, reclaim_maxlatency, CTLFLAG_RD,
+    &pfs_vncache_reclaimmaxns,
+    "longest time an entry spent on the reclaim queue, in ns");
+
+#define PFS_RECLAIM_BATCH	32
+
+/*
+ * Mark an entry dead and queue its vnode for reclaiming.  May be called
+ * with any cache lock held.
+ */
+static void
+pfs_vncache_defer(struct pfs_vdata *pvd)
+{
+
+	OSBitOrAtomic(PVD_DEAD, &pvd->pvd_flags);
+	lck_mtx_lock(pfs_vncache_reclaimlock);
+	if ((pvd->pvd_flags & PVD_RECLAIM) == 0) {
+		pvd->pvd_queued = mach_absolute_time();
+		TAILQ_INSERT_TAIL(&pfs_vncache_reclaimq, pvd, pvd_reclaim);
+		OSBitOrAtomic(PVD_RECLAIM, &pvd->pvd_flags);
+		if (++pfs_vncache_reclaimdepth > pfs_vncache_reclaimmaxdepth)
+			pfs_vncache_reclaimmaxdepth = pfs_vncache_reclaimdepth;
+		if (pfs_vncache_reclaimdepth == 1)
+			wakeup(&pfs_vncache_reclaimq);
+	}
+	lck_mtx_unlock(pfs_vncache_reclaimlock);
+}
 
-static int pfs_vncache_hits;
-SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, hits, CTLFLAG_RD,
-    &pfs_vncache_hits, 0,
-    "number of cache hits since initialization");
+static void
+pfs_vncache_reclaimer(void *arg, wait_result_t wr)
+{
+	struct vnode *vps[PFS_RECLAIM_BATCH];
+	uint32_t vids[PFS_RECLAIM_BATCH];
+	struct pfs_vdata *pvd;
+	uint64_t now, ns;
+	int i, n;
 
-static int pfs_vncache_misses;
-SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, misses, CTLFLAG_RD,
-    &pfs_vncache_misses, 0,
-    "number of cache misses since initialization");
+	lck_mtx_lock(pfs_vncache_reclaimlock);
+	for (;;) {
+		if (TAILQ_EMPTY(&pfs_vncache_reclaimq)) {
+			/* let pfs_vncache_reclaim_drain() know */
+			wakeup(&pfs_vncache_reclaimbusy);
+			if (pfs_vncache_reclaimexit)
+				break;
+			if (pfs_vncache_poolwant) {
+				pfs_vncache_poolwant = 0;
+				lck_mtx_unlock(pfs_vncache_reclaimlock);
+				pfs_vncache_pool_fill();
+				lck_mtx_lock(pfs_vncache_reclaimlock);
+				continue;
+			}
+			msleep(&pfs_vncache_reclaimq, pfs_vncache_reclaimlock,
+			    PVFS, "pfsrcl", NULL);
+			continue;
+		}
+		now = mach_absolute_time();
+		for (n = 0; n < PFS_RECLAIM_BATCH &&
+		    (pvd = TAILQ_FIRST(&pfs_vncache_reclaimq)) != NULL; n++) {
+			TAILQ_REMOVE(&pfs_vncache_reclaimq, pvd, pvd_reclaim);
+			OSBitAndAtomic(~PVD_RECLAIM, &pvd->pvd_flags);
+			pfs_vncache_reclaimdepth--;
+			absolutetime_to_nanoseconds(now - pvd->pvd_queued, &ns);
+			pfs_vncache_reclaimns += ns;
+			if (ns > pfs_vncache_reclaimmaxns)
+				pfs_vncache_reclaimmaxns = ns;
+			/* the entry may be freed once we drop the lock */
+			vps[n] = pvd->pvd_vnode;
+			vids[n] = pvd->pvd_vid;
+		}
+		pfs_vncache_reclaimed += n;
+		pfs_vncache_reclaimbusy = 1;
+		lck_mtx_unlock(pfs_vncache_reclaimlock);
+		for (i = 0; i < n; i++) {
+			if (vnode_getwithvid(vps[i], vids[i]) != 0)
+				continue;
+			pfs_purge_one(vps[i]);
+			vnode_put(vps[i]);
+		}
+		pfs_vncache_pool_fill();
+		lck_mtx_lock(pfs_vncache_reclaimlock);
+		pfs_vncache_reclaimbusy = 0;
+	}
+	pfs_vncache_reclaimrunning = 0;
+	wakeup(&pfs_vncache_reclaimrunning);
+	lck_mtx_unlock(pfs_vncache_reclaimlock);
+	thread_terminate(current_thread());
+}
 
-//extern struct vop_vector pfs_vnodeops;	/* XXX -> .h file */
+/*
+ * Wait until the worker has revoked everything queued so far.
+ */
+static void
+pfs_vncache_reclaim_drain(void)
+{
+
+	lck_mtx_lock(pfs_vncache_reclaimlock);
+	while (!TAILQ_EMPTY(&pfs_vncache_reclaimq) || pfs_vncache_reclaimbusy)
+		msleep(&pfs_vncache_reclaimbusy, pfs_vncache_reclaimlock,
+		    PVFS, "pfsdrn", NULL);
+	lck_mtx_unlock(pfs_vncache_reclaimlock);
+}
+
+static void
+pfs_vncache_reclaim_start(void)
+{
+	thread_t thread;
+
+	lck_mtx_init(pfs_vncache_reclaimlock, NULL, LCK_SLEEP_DEFAULT);
+	TAILQ_INIT(&pfs_vncache_reclaimq);
+	pfs_vncache_reclaimexit = 0;
+	pfs_vncache_reclaimrunning = 1;
+	pfs_vncache_poolwant = 1;
+	if (kernel_thread_start(pfs_vncache_reclaimer, NULL, &thread) !=
+	    KERN_SUCCESS)
+		panic("pfs_vncache_load(): cannot start reclaim worker");
+	thread_deallocate(thread);
+}
 
-static SLIST_HEAD(pfs_vncache_head, pfs_vdata) *pfs_vncache_hashtbl;
-static u_long pfs_vncache_hash;
-#define PFS_VNCACHE_HASH(pid)	(&pfs_vncache_hashtbl[(pid) & pfs_vncache_hash])
+static void
+pfs_vncache_reclaim_stop(void)
+{
+
+	pfs_vncache_reclaim_drain();
+	lck_mtx_lock(pfs_vncache_reclaimlock);
+	pfs_vncache_reclaimexit = 1;
+	wakeup(&pfs_vncache_reclaimq);
+	while (pfs_vncache_reclaimrunning)
+		msleep(&pfs_vncache_reclaimrunning, pfs_vncache_reclaimlock,
+		    PVFS, "pfsrcx", NULL);
+	lck_mtx_unlock(pfs_vncache_reclaimlock);
+	lck_mtx_destroy(pfs_vncache_reclaimlock, NULL);
+}
 
 /*
- * Initialize vnode cache
+ * Vnode pool
+ *
+ * The system does not let a file system keep a reclaimed vnode, so what
+ * is pooled instead is the work done on a miss: the reclaim worker keeps
+ * up to vfs.pfs.vncache.pool_size empty vnodes from vnode_create_empty(),
+ * each paired with a pfs_vdata, and a miss only has to vnode_initialize()
+ * one of them.  The worker tops the pool up whenever it falls below half
+ * of its size and after every batch it reclaims, so vnode allocation is
+ * moved off the lookup path for as long as the pool keeps up.  A miss on
+ * an empty pool falls back to vnode_create().  The pool is protected by
+ * pfs_vncache_poollock, a leaf lock.
+ */
+#define PFS_VNPOOL_MAX		256
+
+static struct pfs_vdata *pfs_vncache_pool[PFS_VNPOOL_MAX];
+
+static int pfs_vncache_poolsize = 32;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, pool_size, CTLFLAG_RW,
+    &pfs_vncache_poolsize, 0,
+    "number of empty vnodes kept ready for misses");
+
+static int pfs_vncache_poolcount;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, pool_count, CTLFLAG_RD,
+    &pfs_vncache_poolcount, 0,
+    "number of empty vnodes currently in the pool");
+
+static uint64_t pfs_vncache_poolhits;
+SYSCTL_QUAD(_vfs_pfs_vncache, OID_AUTO, pool_hits, CTLFLAG_RD,
+    &pfs_vncache_poolhits,
+    "number of misses served from the vnode pool");
+
+static uint64_t pfs_vncache_poolmisses;
+SYSCTL_QUAD(_vfs_pfs_vncache, OID_AUTO, pool_misses, CTLFLAG_RD,
+    &pfs_vncache_poolmisses,
+    "number of misses that found the vnode pool empty");
+
+static int
+pfs_vncache_pool_target(void)
+{
+
+	return (MIN(MAX(pfs_vncache_poolsize, 0), PFS_VNPOOL_MAX));
+}
+
+/*
+ * Take an entry with an empty vnode from the pool, or return NULL.
+ */
+static struct pfs_vdata *
+pfs_vncache_pool_get(void)
+{
+	struct pfs_vdata *pvd;
+	int low, target;
+
+	pvd = NULL;
+	target = pfs_vncache_pool_target();
+	lck_mtx_lock(pfs_vncache_poollock);
+	if (pfs_vncache_poolcount > 0) {
+		pvd = pfs_vncache_pool[--pfs_vncache_poolcount];
+		pfs_vncache_poolhits++;
+	} else if (target > 0) {
+		pfs_vncache_poolmisses++;
+	}
+	/* a disabled pool is emptied by the worker after its next batch */
+	low = target > 0 && pfs_vncache_poolcount < target / 2 + 1;
+	lck_mtx_unlock(pfs_vncache_poollock);
+	if (low && !pfs_vncache_poolwant) {
+		lck_mtx_lock(pfs_vncache_reclaimlock);
+		pfs_vncache_poolwant = 1;
+		wakeup(&pfs_vncache_reclaimq);
+		lck_mtx_unlock(pfs_vncache_reclaimlock);
+	}
+	return (pvd);
+}
+
+static void
+pfs_vncache_pool_discard(struct pfs_vdata *pvd)
+{
+
+	vnode_put(pvd->pvd_vnode);
+	pfs_vdata_free(pvd);
+}
+
+/*
+ * Bring the pool to its configured size.  Called by the reclaim worker
+ * without any lock held, since creating a vnode may sleep.
  */
+static void
+pfs_vncache_pool_fill(void)
+{
+	struct pfs_vdata *pvd;
+	struct vnode *vp;
+
+	lck_mtx_lock(pfs_vncache_poollock);
+	while (pfs_vncache_poolcount > pfs_vncache_pool_target()) {
+		pvd = pfs_vncache_pool[--pfs_vncache_poolcount];
+		lck_mtx_unlock(pfs_vncache_poollock);
+		pfs_vncache_pool_discard(pvd);
+		lck_mtx_lock(pfs_vncache_poollock);
+	}
+	while (pfs_vncache_poolcount < pfs_vncache_pool_target()) {
+		lck_mtx_unlock(pfs_vncache_poollock);
+		vp = NULLVP;
+		if (vnode_create_empty(&vp) != 0)
+			return;
+		pvd = pfs_vdata_alloc();
+		pvd->pvd_vnode = vp;
+		lck_mtx_lock(pfs_vncache_poollock);
+		if (pfs_vncache_poolcount >= pfs_vncache_pool_target()) {
+			lck_mtx_unlock(pfs_vncache_poollock);
+			pfs_vncache_pool_discard(pvd);
+			return;
+		}
+		pfs_vncache_pool[pfs_vncache_poolcount++] = pvd;
+	}
+	lck_mtx_unlock(pfs_vncache_poollock);
+}
+
+/*
+ * Release every pooled vnode.  The reclaim worker must have exited.
+ */
+static void
+pfs_vncache_pool_drain(void)
+{
+
+	while (pfs_vncache_poolcount > 0)
+		pfs_vncache_pool_discard(
+		    pfs_vncache_pool[--pfs_vncache_poolcount]);
+	lck_mtx_destroy(pfs_vncache_poollock, NULL);
+}
+
+/*
+ * Cut the pool down to lowat entries.  Returns the number released.
+ */
+static int
+pfs_vncache_pool_shrink(int lowat)
+{
+	struct pfs_vdata *pvd;
+	int n;
+
+	n = 0;
+	lck_mtx_lock(pfs_vncache_poollock);
+	while (pfs_vncache_poolcount > MAX(lowat, 0)) {
+		pvd = pfs_vncache_pool[--pfs_vncache_poolcount];
+		lck_mtx_unlock(pfs_vncache_poollock);
+		pfs_vncache_pool_discard(pvd);
+		n++;
+		lck_mtx_lock(pfs_vncache_poollock);
+	}
+	lck_mtx_unlock(pfs_vncache_poollock);
+	return (n);
+}
+
+/*
+ * Prewarming
+ *
+ * When vfs.pfs.vncache.prewarm is non-zero, pfs_mount() creates entries
+ * for the static part of the tree down to that many levels below the
+ * root, so that the first lookups after a mount are hits.  Each of these
+ * vnodes is pinned with a use reference, which keeps the system from
+ * recycling it, until pfs_unmount() calls pfs_vncache_unpin().  Static
+ * entries are never on the eviction ring, so the cache does not evict
+ * them either.  Pinned entries are kept on a list protected by
+ * pfs_vncache_pinlock, a leaf lock.
+ */
+static int pfs_vncache_prewarmdepth;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, prewarm, CTLFLAG_RW,
+    &pfs_vncache_prewarmdepth, 0,
+    "depth to which static nodes are cached at mount time (0 to disable)");
+
+static int pfs_vncache_npinned;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, pinned, CTLFLAG_RD,
+    &pfs_vncache_npinned, 0,
+    "number of prewarmed vnodes currently pinned");
+
+/*
+ * Create and pin the vnode of a static node, then do the same for its
+ * children.  Allocating a vnode may sleep, so the directory is unlocked
+ * while each child is visited; a reference keeps the child around, and
+ * the walk stops if the child was detached in the meantime.
+ */
+static void
+pfs_vncache_prewarm_node(struct mount *mp, struct pfs_node *pn, int depth)
+{
+	struct pfs_vdata *pvd;
+	struct pfs_node *iter, *next;
+	struct vnode *vp;
+
+	switch (pn->pn_type) {
+	case pfstype_root:
+	case pfstype_dir:
+	case pfstype_file:
+	case pfstype_symlink:
+		break;
+	default:
+		/* aliases and per-process directories */
+		return;
+	}
+	if ((pn->pn_flags & PFS_PROCDEP) != 0)
+		return;
+	if (pfs_vncache_alloc(mp, &vp, pn, NO_PID) != 0)
+		return;
+	pvd = (struct pfs_vdata *)vp->v_data;
+	lck_mtx_lock(pfs_vncache_pinlock);
+	if ((pvd->pvd_flags & PVD_PINNED) == 0 && vnode_ref(vp) == 0) {
+		LIST_INSERT_HEAD(&pfs_vncache_pinned, pvd, pvd_pinlink);
+		OSBitOrAtomic(PVD_PINNED, &pvd->pvd_flags);
+		pfs_vncache_npinned++;
+	}
+	lck_mtx_unlock(pfs_vncache_pinlock);
+	vnode_put(vp);
+	if (depth == 0)
+		return;
+	pfs_lock(pn);
+	for (iter = pn->pn_nodes; iter != NULL; iter = next) {
+		pfs_node_hold(iter);
+		pfs_unlock(pn);
+		pfs_vncache_prewarm_node(mp, iter, depth - 1);
+		pfs_lock(pn);
+		next = (iter->pn_parent == pn) ? iter->pn_next : NULL;
+		pfs_node_rele(iter);
+	}
+	pfs_unlock(pn);
+}
+
 void
-pfs_vncache_load(void)
+pfs_vncache_prewarm(struct mount *mp, struct pfs_node *root)
 {
+	int depth;
 
-	lck_mtx_init(&pfs_vncache_mutex, NULL, LCK_SLEEP_DEFAULT);
-	pfs_vncache_hashtbl = hashinit(maxproc / 4, M_PFSVNCACHE, &pfs_vncache_hash);
-//	pfs_exit_tag = EVENTHANDLER_REGISTER(process_exit, pfs_exit, NULL,
-//	    EVENTHANDLER_PRI_ANY);
+	depth = pfs_vncache_prewarmdepth;
+	if (depth > 0)
+		pfs_vncache_prewarm_node(mp, root, depth);
 }
 
 /*
- * Tear down vnode cache
+ * Drop the use references taken by pfs_vncache_prewarm() on a mount's
+ * vnodes, so that they can be flushed.
  */
 void
-pfs_vncache_unload(void)
+pfs_vncache_unpin(struct mount *mp)
 {
+	struct pfs_vdata *pvd, *next;
+	struct vnode *vps[PFS_RECLAIM_BATCH];
+	int i, n;
 
-//	EVENTHANDLER_DEREGISTER(process_exit, pfs_exit_tag);
-	pfs_purge_all();
-	KASSERT(pfs_vncache_entries == 0,
-	    ("%d vncache entries remaining", pfs_vncache_entries));
-	lck_mtx_destroy(&pfs_vncache_mutex, NULL);
+	do {
+		n = 0;
+		lck_mtx_lock(pfs_vncache_pinlock);
+		LIST_FOREACH_SAFE(pvd, &pfs_vncache_pinned, pvd_pinlink, next) {
+			if (pvd->pvd_vnode->v_mount != mp)
+				continue;
+			LIST_REMOVE(pvd, pvd_pinlink);
+			OSBitAndAtomic(~PVD_PINNED, &pvd->pvd_flags);
+			pfs_vncache_npinned--;
+			vps[n++] = pvd->pvd_vnode;
+			if (n == PFS_RECLAIM_BATCH)
+				break;
+		}
+		lck_mtx_unlock(pfs_vncache_pinlock);
+		/* the use reference keeps the vnode and its entry around */
+		for (i = 0; i < n; i++)
+			vnode_rele(vps[i]);
+	} while (n == PFS_RECLAIM_BATCH);
+}
+
+/*
+ * Evict up to n idle entries and return how many went.  The hand moves
+ * each entry it passes to the tail of the ring; a referenced entry only
+ * loses its reference bit, and an unreferenced one has its vnode recycled
+ * unless somebody holds a use reference on it.  A sweep looks at no more
+ * than PFS_VNCACHE_SCAN entries, and at no entry more than twice.  Called
+ * without any cache lock held, since a recycled vnode re-enters the cache
+ * through pfs_vncache_free() once the last I/O reference is dropped.
+ */
+static int
+pfs_vncache_evict(int n)
+{
+	struct pfs_vdata *pvd;
+	struct vnode *vp;
+	uint32_t vid;
+	int evicted, scan;
+
+	evicted = 0;
+	lck_mtx_lock(pfs_vncache_clocklock);
+	scan = MIN(2 * pfs_vncache_nclock, PFS_VNCACHE_SCAN);
+	while (n > 0 && scan-- > 0 &&
+	    (pvd = TAILQ_FIRST(&pfs_vncache_clock)) != NULL) {
+		TAILQ_REMOVE(&pfs_vncache_clock, pvd, pvd_clock);
+		TAILQ_INSERT_TAIL(&pfs_vncache_clock, pvd, pvd_clock);
+		if ((pvd->pvd_flags & PVD_REFERENCED) != 0) {
+			OSBitAndAtomic(~PVD_REFERENCED, &pvd->pvd_flags);
+			continue;
+		}
+		if ((pvd->pvd_flags & PVD_DEAD) != 0)
+			continue;
+		/* the entry may be freed once we let go of the ring */
+		vp = pvd->pvd_vnode;
+		vid = pvd->pvd_vid;
+		lck_mtx_unlock(pfs_vncache_clocklock);
+		if (vnode_getwithvid(vp, vid) == 0) {
+			if (vnode_isinuse(vp, 0)) {
+				OSIncrementAtomic(&pfs_vncache_evictbusy);
+			} else {
+				vnode_recycle(vp);
+				OSIncrementAtomic(&pfs_vncache_evictions);
+				evicted++;
+				n--;
+			}
+			vnode_put(vp);
+		}
+		lck_mtx_lock(pfs_vncache_clocklock);
+	}
+	lck_mtx_unlock(pfs_vncache_clocklock);
+	return (evicted);
+}
+
+/*
+ * Memory pressure
+ *
+ * pfs_vncache_shrink() hands memory held by the caches back to the
+ * system: idle entries are evicted until the vnode cache is down to
+ * vfs.pfs.vncache.lowat_entries, the vnode pool is cut to lowat_pool
+ * entries, and the pfs_vdata object cache is cut to lowat_vdata objects.
+ * XNU has no memory pressure notification for kernel extensions, so the
+ * routine is available to consumers that have their own signal and can
+ * be run by writing a non-zero value to vfs.pfs.vncache.shrink.  What
+ * each cache released is accumulated in the shrink_*_bytes counters.
+ * Evicted and pooled entries are counted as pfs_vdata handed back to the
+ * object cache; shrink_vdata_bytes is what actually reached free().
+ */
+static int pfs_vncache_lowatpool;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, lowat_pool, CTLFLAG_RW,
+    &pfs_vncache_lowatpool, 0,
+    "number of empty vnodes the pool is shrunk to under memory pressure");
+
+static int pfs_vncache_lowatvdata;
+SYSCTL_INT(_vfs_pfs_vncache, OID_AUTO, lowat_vdata, CTLFLAG_RW,
+    &pfs_vncache_lowatvdata, 0,
+    "number of free vnode data objects kept under memory pressure");
+
+static uint64_t pfs_vncache_shrinks;
+SYSCTL_QUAD(_vfs_pfs_vncache, OID_AUTO, shrinks, CTLFLAG_RD,
+    &pfs_vncache_shrinks,
+    "number of times the caches were shrunk");
+
+static uint64_t pfs_vncache_shrinkbytes;
+SYSCTL_QUAD(_vfs_pfs_vncache, OID_AUTO, shrink_vncache_bytes, CTLFLAG_RD,
+    &pfs_vncache_shrinkbytes,
+    "vnode data released by evicting idle vnode cache entries");
+
+static uint64_t pfs_vncache_shrinkpoolbytes;
+SYSCTL_QUAD(_vfs_pfs_vncache, OID_AUTO, shrink_pool_bytes, CTLFLAG_RD,
+    &pfs_vncache_shrinkpoolbytes,
+    "vnode data released by shrinking the vnode pool");
+
+static uint64_t pfs_vncache_shrinkvdatabytes;
+SYSCTL_QUAD(_vfs_pfs_vncache, OID_AUTO, shrink_vdata_bytes, CTLFLAG_RD,
+    &pfs_vncache_shrinkvdatabytes,
+    "memory freed by shrinking the vnode data object cache");
+
+void
+pfs_vncache_shrink(void)
+{
+	int64_t excess;
+	int n, passes;
+
+	excess = PFS_VNCACHE_ENTRIES() - MAX(pfs_vncache_lowatentries, 0);
+	/* enough sweeps to pass every ring entry twice */
+	passes = 2 * pfs_vncache_nclock / PFS_VNCACHE_SCAN + 1;
+	while (excess > 0 && passes-- > 0) {
+		n = pfs_vncache_evict((int)MIN(excess, INT_MAX));
+		OSAddAtomic64((int64_t)n * sizeof(struct pfs_vdata),
+		    (volatile SInt64 *)&pfs_vncache_shrinkbytes);
+		excess -= n;
+	}
+	n = pfs_vncache_pool_shrink(pfs_vncache_lowatpool);
+	OSAddAtomic64((int64_t)n * sizeof(struct pfs_vdata),
+	    (volatile SInt64 *)&pfs_vncache_shrinkpoolbytes);
+	/* return what the evictions retired to the object cache first */
+	pfs_vncache_reap();
+	OSAddAtomic64((int64_t)pfs_vdcache_shrink(pfs_vncache_lowatvdata),
+	    (volatile SInt64 *)&pfs_vncache_shrinkvdatabytes);
+	OSIncrementAtomic64((volatile SInt64 *)&pfs_vncache_shrinks);
+}
+
+static int
+sysctl_pfs_vncache_shrink(SYSCTL_HANDLER_ARGS)
+{
+	int error, val;
+
+	val = 0;
+	error = SYSCTL_OUT(req, &val, sizeof val);
+	if (error != 0 || req->newptr == USER_ADDR_NULL)
+		return (error);
+	error = SYSCTL_IN(req, &val, sizeof val);
+	if (error == 0 && val != 0)
+		pfs_vncache_shrink();
+	return (error);
 }
 
+SYSCTL_PROC(_vfs_pfs_vncache, OID_AUTO, shrink, CTLTYPE_INT | CTLFLAG_RW,
+    NULL, 0, sysctl_pfs_vncache_shrink, "I",
+    "write a non-zero value to shrink the caches as under memory pressure");
+
 /*
  * Allocate a vnode
  */
@@ -117,56 +1852,99 @@ int
 pfs_vncache_alloc(struct mount *mp, struct vnode **vpp,
 		  struct pfs_node *pn, pid_t pid)
 {
-	struct pfs_vncache_head *hash;
+	struct pfs_vncache *vc;
 	struct pfs_vdata *pvd, *pvd2;
-	struct vnode *vp;
-//	enum vgetstate vs;
-	int error;
+	struct pfs_vnpid *pp, *newpp;
+	struct vnode *vp, *vp2;
+	lck_mtx_t *lock, *pidlock;
+	u_long hashval;
+	uint64_t held;
+	uint32_t vid;
+	u_int seq;
+	int chainlen, entries, error, found, probes, seqvalid;
 
 	/*
-	 * See if the vnode is in the cache.
+	 * See if the vnode is in the cache.  Hits are normally served by
+	 * the lock-free walk; only a miss there is confirmed under the
+	 * chain lock.  Either way, the entry may be freed as soon as it is
+	 * found, so the vnode is only used if its vid still matches.
 	 */
-	hash = PFS_VNCACHE_HASH(pid);
-	if (SLIST_EMPTY(hash))
-		goto alloc;
-retry:
-	lck_mtx_lock(&pfs_vncache_mutex);
-	SLIST_FOREACH(pvd, hash, pvd_hash) {
-		if (pvd->pvd_pn == pn && pvd->pvd_pid == pid &&
-		    pvd->pvd_vnode->v_mount == mp) {
+	vc = pn->pn_info->pi_vncache;
+	hashval = pfs_vncache_hashval(pn, pid, mp);
+	lock = PFS_VNCACHE_LOCK(vc, hashval);
+	probes = 0;
+	seq = 0;
+	seqvalid = 0;
+	found = pfs_vncache_lookup(vc, hashval, pn, pid, mp, &vp, &vid,
+	    &probes);
+	if (!found) {
+		lck_rw_lock_shared(vc->vc_tbllock);
+		held = pfs_vncache_chainlock(lock);
+		chainlen = 0;
+		pvd = pfs_vncache_find(vc, hashval, pn, pid, mp, &chainlen);
+		probes += chainlen;
+		if (pvd == NULL) {
+			seq = PFS_VNCACHE_SEQ(vc, hashval);
+			seqvalid = 1;
+		} else {
+			if ((pvd->pvd_flags & PVD_REFERENCED) == 0)
+				OSBitOrAtomic(PVD_REFERENCED, &pvd->pvd_flags);
 			vp = pvd->pvd_vnode;
-//			vs = vget_prep(vp);
-			lck_mtx_unlock(&pfs_vncache_mutex);
-//			if (vget_finish(vp, LK_EXCLUSIVE, vs) == 0) {
-//				++pfs_vncache_hits;
-//				*vpp = vp;
-				/*
-				 * Some callers cache_enter(vp) later, so
-				 * we have to make sure it's not in the
-				 * VFS cache so it doesn't get entered
-				 * twice.  A better solution would be to
-				 * make pfs_vncache_alloc() responsible
-				 * for entering the vnode in the VFS
-				 * cache.
-				 */
-//				cache_purge(vp);
-//				return (0);
-//			}
-//			goto retry;
-		}
-	}
-	lck_mtx_unlock(&pfs_vncache_mutex);
-alloc:
-	/* nope, get a new one */
-	pvd = malloc(sizeof *pvd, M_PFSVNCACHE, M_WAITOK);
-	error = pfs_getnewvnode(mp, NULL, NULL, &vp, NULL, 1);
-	if (error) {
-		FREE(pvd, M_PFSVNCACHE);
-		return (error);
+			vid = pvd->pvd_vid;
+			found = 1;
+		}
+		pfs_vncache_chainunlock(lock, held);
+		pfs_vncache_migrate(vc);
+		lck_rw_unlock_shared(vc->vc_tbllock);
+	}
+	PFS_VNCACHE_HIST(pc_probes, probes);
+	if (found && vnode_getwithvid(vp, vid) == 0) {
+		PFS_VNCACHE_COUNT(pc_hits, 1);
+		*vpp = vp;
+		/*
+		 * Some callers cache_enter(vp) later, so
+		 * we have to make sure it's not in the
+		 * VFS cache so it doesn't get entered
+		 * twice.  A better solution would be to
+		 * make pfs_vncache_alloc() responsible
+		 * for entering the vnode in the VFS
+		 * cache.
+		 */
+		cache_purge(vp);
+		return (0);
+	}
+
+	/*
+	 * Nope, get a new one.  The entry is the vnode's only private
+	 * data and is handed to vnode_create() as its fsnode; if the pool
+	 * has one, the entry comes with an empty vnode to initialize.
+	 */
+	pvd = pfs_vncache_pool_get();
+	if (pvd == NULL) {
+		pvd = pfs_vdata_alloc();
+		pvd->pvd_vnode = NULLVP;
 	}
+	vp = pvd->pvd_vnode;
+	pvd->pvd_cache = vc;
 	pvd->pvd_pn = pn;
 	pvd->pvd_pid = pid;
-	(*vpp)->v_data = pvd;
+	pvd->pvd_flags = 0;
+	pvd->pvd_hashval = hashval;
+	pvd->pvd_pidrec = NULL;
+	/*
+	 * The entry keeps the node and the cache instance alive until the
+	 * vnode is reclaimed.
+	 */
+	pfs_node_hold(pn);
+	pfs_vncache_hold(vc);
+	error = pfs_getnewvnode(mp, NULL, NULL, &vp, NULL, 1, pvd);
+	if (error) {
+		pfs_vncache_rele(vc);
+		pfs_node_rele(pn);
+		pfs_vdata_free(pvd);
+		return (error);
+	}
+	*vpp = vp;
 	switch (pn->pn_type) {
 	case pfstype_root:
 		(*vpp)->v_flag = VV_ROOT;
@@ -198,6 +1976,7 @@ alloc:
 	if ((pn->pn_flags & PFS_PROCDEP) != 0)
 		(*vpp)->v_flag |= VV_PROCDEP;
 	pvd->pvd_vnode = *vpp;
+	pvd->pvd_vid = vnode_vid(*vpp);
 //	vn_lock(*vpp, LK_EXCLUSIVE | LK_RETRY);
 	VN_LOCK_AREC(*vpp);
 //	error = insmntque(*vpp, mp);
@@ -206,38 +1985,115 @@ alloc:
 //		*vpp = NULLVP;
 //		return (error);
 //	}
+	newpp = NULL;
 retry2:
-	lck_mtx_lock(&pfs_vncache_mutex);
+	pfs_lock(pn);
+	if (pn->pn_dead) {
+		/* pfs_destroy() has purged the node; do not cache it again */
+		pfs_unlock(pn);
+		vnode_recycle(vp);
+		vnode_put(vp);
+		*vpp = NULLVP;
+		return (ENOENT);
+	}
+	lck_rw_lock_shared(vc->vc_tbllock);
+	held = pfs_vncache_chainlock(lock);
 	/*
 	 * Other thread may race with us, creating the entry we are
-	 * going to insert into the cache. Recheck after
-	 * pfs_vncache_mutex is reacquired.
+	 * going to insert into the cache. Recheck after the chain
+	 * lock is reacquired, unless nothing was linked into any chain
+	 * of this stripe since our own search came up empty.
 	 */
-	SLIST_FOREACH(pvd2, hash, pvd_hash) {
-		if (pvd2->pvd_pn == pn && pvd2->pvd_pid == pid &&
-		    pvd2->pvd_vnode->v_mount == mp) {
-			vp = pvd2->pvd_vnode;
-#if !defined(MACH_KERNEL_PRIVATE) && !defined(__APPLE_API_PRIVATE)
-#define MACH_KERNEL_PRIVATE && __APPLE_API_PRIVATE
-			VI_LOCK(vp);
-#endif
-			lck_mtx_unlock(&pfs_vncache_mutex);
-//			if (vget(vp, LK_EXCLUSIVE | LK_INTERLOCK) == 0) {
-//				++pfs_vncache_hits;
-//				vgone(*vpp);
-//				vput(*vpp);
-//				*vpp = vp;
-//				cache_purge(vp);
-//				return (0);
-//			}
-//			goto retry2;
-		}
-	}
-	++pfs_vncache_misses;
-	if (++pfs_vncache_entries > pfs_vncache_maxentries)
-		pfs_vncache_maxentries = pfs_vncache_entries;
-	SLIST_INSERT_HEAD(hash, pvd, pvd_hash);
-	lck_mtx_unlock(&pfs_vncache_mutex);
+	if (seqvalid && PFS_VNCACHE_SEQ(vc, hashval) == seq) {
+		pvd2 = NULL;
+	} else {
+		chainlen = 0;
+		pvd2 = pfs_vncache_find(vc, hashval, pn, pid, mp, &chainlen);
+		seq = PFS_VNCACHE_SEQ(vc, hashval);
+		seqvalid = 1;
+	}
+	if (pvd2 != NULL) {
+		/*
+		 * Use the racing entry and throw ours away.  Our vnode was
+		 * never published, and reclaiming it frees pvd.  If the
+		 * other vnode is going away as well, search again; the
+		 * dying entry no longer matches.
+		 */
+		vp2 = pvd2->pvd_vnode;
+		vid = pvd2->pvd_vid;
+		pfs_vncache_chainunlock(lock, held);
+		lck_rw_unlock_shared(vc->vc_tbllock);
+		pfs_unlock(pn);
+		if (vnode_getwithvid(vp2, vid) != 0) {
+			seqvalid = 0;
+			goto retry2;
+		}
+		if (newpp != NULL)
+			FREE(newpp, M_PFSVNCACHE);
+		vnode_recycle(vp);
+		vnode_put(vp);
+		PFS_VNCACHE_COUNT(pc_hits, 1);
+		*vpp = vp2;
+		cache_purge(vp2);
+		return (0);
+	}
+	if (pid != NO_PID) {
+		pidlock = PFS_VNCACHE_PIDLOCK(pid);
+		lck_mtx_lock(pidlock);
+		pp = pfs_vncache_pidfind(pid);
+		if (pp == NULL && newpp == NULL) {
+			/* first entry for this pid; allocate unlocked */
+			lck_mtx_unlock(pidlock);
+			pfs_vncache_chainunlock(lock, held);
+			lck_rw_unlock_shared(vc->vc_tbllock);
+			pfs_unlock(pn);
+			newpp = malloc(sizeof *newpp, M_PFSVNCACHE, M_WAITOK);
+			goto retry2;
+		}
+		if (pp == NULL) {
+			pp = newpp;
+			newpp = NULL;
+			LIST_INIT(&pp->pp_vdata);
+			pp->pp_pid = pid;
+			pp->pp_hashed = 1;
+			LIST_INSERT_HEAD(PFS_VNCACHE_PIDHASH(pid), pp, pp_link);
+		}
+		LIST_INSERT_HEAD(&pp->pp_vdata, pvd, pvd_pidlink);
+		pvd->pvd_pidrec = pp;
+		OSBitOrAtomic(PVD_PIDLIST, &pvd->pvd_flags);
+		lck_mtx_unlock(pidlock);
+		/* new entries start out referenced, at the far end */
+		lck_mtx_lock(pfs_vncache_clocklock);
+		TAILQ_INSERT_TAIL(&pfs_vncache_clock, pvd, pvd_clock);
+		pfs_vncache_nclock++;
+		OSBitOrAtomic(PVD_CLOCK | PVD_REFERENCED, &pvd->pvd_flags);
+		lck_mtx_unlock(pfs_vncache_clocklock);
+	}
+	/*
+	 * New entries always go into the current table.  The counters are
+	 * per CPU and are not covered by any one lock, so the entry count
+	 * is a snapshot; peakentries is a statistic and may lag.
+	 */
+	pfs_vncache_publish(PFS_VNCACHE_HASH(vc, hashval), pvd);
+	OSBitOrAtomic(PVD_HASHED, &pvd->pvd_flags);
+	OSIncrementAtomic(&vc->vc_entries);
+	LIST_INSERT_HEAD(&pn->pn_vdata, pvd, pvd_nodelink);
+	OSBitOrAtomic(PVD_NODELIST, &pvd->pvd_flags);
+	pfs_vncache_chainunlock(lock, held);
+	PFS_VNCACHE_HIST(pc_chainlen, chainlen);
+	pfs_vncache_migrate(vc);
+	lck_rw_unlock_shared(vc->vc_tbllock);
+	pfs_unlock(pn);
+	if (newpp != NULL)
+		FREE(newpp, M_PFSVNCACHE);
+	PFS_VNCACHE_COUNT(pc_misses, 1);
+	PFS_VNCACHE_COUNT(pc_entries, 1);
+	entries = (int)PFS_VNCACHE_ENTRIES();
+	if (entries > pfs_vncache_peakentries)
+		pfs_vncache_peakentries = entries;
+	pfs_vncache_resize(vc);
+	if (pfs_vncache_maxentries > 0 && entries > pfs_vncache_maxentries)
+		pfs_vncache_evict(entries - pfs_vncache_maxentries);
 	return (0);
 }
 
@@ -247,40 +2103,102 @@ retry2:
 int
 pfs_vncache_free(struct vnode *vp)
 {
-	struct pfs_vdata *pvd, *pvd2;
+	struct pfs_vncache *vc;
+	struct pfs_vdata *pvd;
+	struct pfs_node *pn;
+	lck_mtx_t *lock;
+	uint64_t held;
+	int found;
 
-	lck_mtx_lock(&pfs_vncache_mutex);
 	pvd = (struct pfs_vdata *)vp->v_data;
 	KASSERT(pvd != NULL, ("pfs_vncache_free(): no vnode data\n"));
-	SLIST_FOREACH(pvd2, PFS_VNCACHE_HASH(pvd->pvd_pid), pvd_hash) {
-		if (pvd2 != pvd)
-			continue;
-		SLIST_REMOVE(PFS_VNCACHE_HASH(pvd->pvd_pid), pvd, pfs_vdata, pvd_hash);
-		--pfs_vncache_entries;
-		break;
+	OSBitOrAtomic(PVD_DEAD, &pvd->pvd_flags);
+	/*
+	 * The entry holds a reference on its node, which is dropped last,
+	 * so the node is still there even if pfs_destroy() has run.  The
+	 * node lock is taken even if the entry is no longer on the node's
+	 * list, so that a pfs_purge() or pfs_exit() that took it off has
+	 * finished queueing it by the time we look at the reclaim queue.
+	 */
+	pn = pvd->pvd_pn;
+	pfs_lock(pn);
+	if ((pvd->pvd_flags & PVD_NODELIST) != 0) {
+		LIST_REMOVE(pvd, pvd_nodelink);
+		OSBitAndAtomic(~PVD_NODELIST, &pvd->pvd_flags);
+	}
+	pfs_unlock(pn);
+	pfs_vncache_pidunlink(pvd);
+	if ((pvd->pvd_flags & PVD_CLOCK) != 0) {
+		lck_mtx_lock(pfs_vncache_clocklock);
+		if ((pvd->pvd_flags & PVD_CLOCK) != 0) {
+			TAILQ_REMOVE(&pfs_vncache_clock, pvd, pvd_clock);
+			pfs_vncache_nclock--;
+			OSBitAndAtomic(~PVD_CLOCK, &pvd->pvd_flags);
+		}
+		lck_mtx_unlock(pfs_vncache_clocklock);
+	}
+	if ((pvd->pvd_flags & PVD_PINNED) != 0) {
+		/* revoked from under its use reference */
+		lck_mtx_lock(pfs_vncache_pinlock);
+		if ((pvd->pvd_flags & PVD_PINNED) != 0) {
+			LIST_REMOVE(pvd, pvd_pinlink);
+			pfs_vncache_npinned--;
+			OSBitAndAtomic(~PVD_PINNED, &pvd->pvd_flags);
+		}
+		lck_mtx_unlock(pfs_vncache_pinlock);
+	}
+	/*
+	 * The entry also holds a reference on its cache instance, so the
+	 * instance is still there even if pfs_vncache_destroy() has run.
+	 */
+	vc = pvd->pvd_cache;
+	lock = PFS_VNCACHE_LOCK(vc, pvd->pvd_hashval);
+	lck_rw_lock_shared(vc->vc_tbllock);
+	held = pfs_vncache_chainlock(lock);
+	found = pfs_vncache_unlink(pvd);
+	pfs_vncache_chainunlock(lock, held);
+	pfs_vncache_migrate(vc);
+	lck_rw_unlock_shared(vc->vc_tbllock);
+	/*
+	 * Once the entry is off every list and out of the hash, nothing can
+	 * queue it again; take it off the reclaim queue last.
+	 */
+	if ((pvd->pvd_flags & PVD_RECLAIM) != 0) {
+		lck_mtx_lock(pfs_vncache_reclaimlock);
+		if ((pvd->pvd_flags & PVD_RECLAIM) != 0) {
+			TAILQ_REMOVE(&pfs_vncache_reclaimq, pvd, pvd_reclaim);
+			pfs_vncache_reclaimdepth--;
+			OSBitAndAtomic(~PVD_RECLAIM, &pvd->pvd_flags);
+		}
+		lck_mtx_unlock(pfs_vncache_reclaimlock);
 	}
-	lck_mtx_unlock(&pfs_vncache_mutex);
+	if (found)
+		PFS_VNCACHE_COUNT(pc_entries, -1);
+	/* a purged entry was uncounted early, but still lets the table shrink */
+	pfs_vncache_resize(vc);
 
-	FREE(pvd, M_PFSVNCACHE);
 	vp->v_data = NULL;
+	pfs_vncache_retire(pvd);
+	pfs_vncache_rele(vc);
+	pfs_node_rele(pn);
 	return (0);
 }
 
 /*
  * Purge the cache of dead entries
  *
- * The code is not very efficient and this perhaps can be addressed without
- * a complete rewrite. Previous iteration was walking a linked list from
- * scratch every time. This code only walks the relevant hash chain (if pid
- * is provided), but still resorts to scanning the entire cache at least twice
- * if a specific component is to be removed which is slower. This can be
- * augmented with resizing the hash.
+ * The purge routines only detach entries, mark them dead and hand them to
+ * the reclaim worker, which revokes their vnodes later.  Since none of
+ * this sleeps or re-enters the cache, they never have to drop their locks
+ * in the middle of a walk, and the cost of a purge is linear in the number
+ * of entries it removes (plus one pass over the table for
+ * pfs_purge_all()).
  *
  * Explanation of the previous state:
  *
  * This is extremely inefficient due to the fact that vgone() not only
  * indirectly modifies the vnode cache, but may also sleep.  We can
- * neither hold pfs_vncache_mutex across a vgone() call, nor make any
+ * neither hold a chain lock across a vgone() call, nor make any
  * assumptions about the state of the cache after vgone() returns.  In
  * consequence, we must start over after every vgone() call, and keep
  * trying until we manage to traverse the entire cache.
@@ -289,79 +2207,270 @@ pfs_vncache_free(struct vnode *vp)
  * used to implement the cache.
  */
 
+/*
+ * Revoke a vnode.  The caller holds an I/O reference on it, taken with
+ * vnode_getwithvid() so that a vnode recycled in the meantime is left
+ * alone; the vnode is reclaimed when that reference is dropped.
+ */
 static void
 pfs_purge_one(struct vnode *vnp)
 {
-#ifndef KERNEL
-#define KERNEL
-	VOP_LOCK(vnp, LK_EXCLUSIVE);
-//	vgone(vnp);
-	VOP_UNLOCK(vnp);
-//	vdrop(vnp);
-#endif
+
+	vnode_recycle(vnp);
 }
 
-void
-pfs_purge(struct pfs_node *pn)
+/*
+ * Revoke every vnode of one cache instance.  The node locks come before
+ * the table and chain locks, so, as in pfs_exit(), live entries are
+ * collected a batch at a time under their chain lock, with a node
+ * reference each, and detached by pfs_purge_entry() once it is dropped.
+ * The old table is walked before the current one, so an entry migrated
+ * during the walk is never missed, and the walk starts over if a resize
+ * installs or retires a table in between two batches.
+ */
+static void
+pfs_purge_cache(struct pfs_vncache *vc)
 {
+	struct pfs_vdata *pvds[PFS_RECLAIM_BATCH];
+	struct pfs_vncache_head *tbl;
 	struct pfs_vdata *pvd;
-	struct vnode *vnp;
-	u_long i, removed;
-
-	lck_mtx_lock(&pfs_vncache_mutex);
-restart:
-	removed = 0;
-	for (i = 0; i < pfs_vncache_hash; i++) {
-restart_chain:
-		SLIST_FOREACH(pvd, &pfs_vncache_hashtbl[i], pvd_hash) {
-			if (pn != NULL && pvd->pvd_pn != pn)
+	struct pfs_node *pn;
+	lck_mtx_t *lock;
+	u_long gen, hash, i;
+	int j, n, t, token;
+
+	gen = vc->vc_gen;
+	t = 0;
+	i = 0;
+	do {
+		token = pfs_vncache_read_enter();
+		n = 0;
+		lck_rw_lock_shared(vc->vc_tbllock);
+		if (vc->vc_gen != gen) {
+			gen = vc->vc_gen;
+			t = 0;
+			i = 0;
+		}
+		for (; t < 2; t++, i = 0) {
+			tbl = (t == 0) ? vc->vc_oldtbl : vc->vc_hashtbl;
+			hash = (t == 0) ? vc->vc_oldhash : vc->vc_hash;
+			if (tbl == NULL)
 				continue;
-			vnp = pvd->pvd_vnode;
-//			vhold(vnp);
-			lck_mtx_unlock(&pfs_vncache_mutex);
-			pfs_purge_one(vnp);
-			removed++;
-			lck_mtx_lock(&pfs_vncache_mutex);
-			goto restart_chain;
+			for (; i <= hash; i++) {
+				lock = PFS_VNCACHE_CHAINLOCK(vc, i);
+				lck_mtx_lock(lock);
+				SLIST_FOREACH(pvd, &tbl[i], pvd_hash) {
+					if (n == PFS_RECLAIM_BATCH)
+						break;
+					if ((pvd->pvd_flags & PVD_DEAD) != 0)
+						continue;
+					pfs_node_hold(pvd->pvd_pn);
+					pvds[n++] = pvd;
+				}
+				lck_mtx_unlock(lock);
+				/* a full batch may not have the whole chain */
+				if (n == PFS_RECLAIM_BATCH)
+					break;
+			}
+			if (n == PFS_RECLAIM_BATCH)
+				break;
 		}
-	}
-	if (removed > 0)
-		goto restart;
-	lck_mtx_unlock(&pfs_vncache_mutex);
+		lck_rw_unlock_shared(vc->vc_tbllock);
+		for (j = 0; j < n; j++) {
+			pvd = pvds[j];
+			pn = pvd->pvd_pn;
+			pfs_lock(pn);
+			lck_rw_lock_shared(vc->vc_tbllock);
+			if ((pvd->pvd_flags & PVD_NODELIST) != 0)
+				pfs_purge_entry(pvd);
+			lck_rw_unlock_shared(vc->vc_tbllock);
+			pfs_unlock(pn);
+			pfs_node_rele(pn);
+		}
+		pfs_vncache_read_exit(token);
+	} while (n == PFS_RECLAIM_BATCH);
 }
 
+/*
+ * Revoke every cached vnode of every instance.
+ */
 static void
 pfs_purge_all(void)
 {
+	struct pfs_vncache *vc;
+
+	lck_mtx_lock(pfs_vncache_listlock);
+	LIST_FOREACH(vc, &pfs_vncache_list, vc_link)
+		pfs_purge_cache(vc);
+	lck_mtx_unlock(pfs_vncache_listlock);
+}
+
+/*
+ * Take an entry off its node's list, its hash chain, its process' list
+ * and the eviction ring, and hand it to the reclaim worker.  Called with the entry's node
+ * locked and the table lock of its cache instance held shared.
+ */
+static void
+pfs_purge_entry(struct pfs_vdata *pvd)
+{
+	lck_mtx_t *lock;
+
+	LIST_REMOVE(pvd, pvd_nodelink);
+	OSBitAndAtomic(~PVD_NODELIST, &pvd->pvd_flags);
+	lock = PFS_VNCACHE_LOCK(pvd->pvd_cache, pvd->pvd_hashval);
+	lck_mtx_lock(lock);
+	if (pfs_vncache_unlink(pvd))
+		PFS_VNCACHE_COUNT(pc_entries, -1);
+	lck_mtx_unlock(lock);
+	pfs_vncache_pidunlink(pvd);
+	if ((pvd->pvd_flags & PVD_CLOCK) != 0) {
+		lck_mtx_lock(pfs_vncache_clocklock);
+		if ((pvd->pvd_flags & PVD_CLOCK) != 0) {
+			TAILQ_REMOVE(&pfs_vncache_clock, pvd, pvd_clock);
+			pfs_vncache_nclock--;
+			OSBitAndAtomic(~PVD_CLOCK, &pvd->pvd_flags);
+		}
+		lck_mtx_unlock(pfs_vncache_clocklock);
+	}
+	pfs_vncache_defer(pvd);
+}
+
+/*
+ * Revoke the vnodes of a single node, which are found on the node's own
+ * list.
+ */
+void
+pfs_purge(struct pfs_node *pn)
+{
+	struct pfs_vncache *vc;
+	struct pfs_vdata *pvd;
 
-	pfs_purge(NULL);
+	if (pn == NULL) {
+		pfs_purge_all();
+		return;
+	}
+	vc = pn->pn_info->pi_vncache;
+	pfs_lock(pn);
+	lck_rw_lock_shared(vc->vc_tbllock);
+	while ((pvd = LIST_FIRST(&pn->pn_vdata)) != NULL)
+		pfs_purge_entry(pvd);
+	lck_rw_unlock_shared(vc->vc_tbllock);
+	pfs_unlock(pn);
 }
 
 /*
  * Free all vnodes associated with a defunct process
+ *
+ * The process' record is taken out of the pid table in one locked step,
+ * which detaches its whole entry list: later entries for a recycled pid
+ * start a new record.  The entries are then unlinked as pfs_purge() does
+ * and handed to the reclaim worker, so the cost is linear in the number
+ * of vnodes the process had.
+ *
+ * The node and hash locks come before the pid locks, so entries are
+ * taken off the list a batch at a time and unlinked after the pid lock
+ * is dropped.  A read-side section keeps them from being freed meanwhile,
+ * and a node reference keeps their node around; an entry that is no
+ * longer on its node's list has been taken care of by pfs_vncache_free()
+ * or pfs_purge().
  */
 static void
-pfs_exit(void *arg, struct proc *p)
+pfs_exit(pid_t pid)
 {
-	struct pfs_vncache_head *hash;
+	struct pfs_vdata *pvds[PFS_RECLAIM_BATCH];
+	struct pfs_vncache *vc;
+	struct pfs_vnpid *pp;
 	struct pfs_vdata *pvd;
-	struct vnode *vnp;
-	int pid;
+	struct pfs_node *pn;
+	lck_mtx_t *lock;
+	int i, n, token;
+
+	lock = PFS_VNCACHE_PIDLOCK(pid);
+	lck_mtx_lock(lock);
+	pp = pfs_vncache_pidfind(pid);
+	if (pp == NULL) {
+		lck_mtx_unlock(lock);
+		return;
+	}
+	LIST_REMOVE(pp, pp_link);
+	pp->pp_hashed = 0;
+	lck_mtx_unlock(lock);
+	do {
+		token = pfs_vncache_read_enter();
+		n = 0;
+		lck_mtx_lock(lock);
+		while (n < PFS_RECLAIM_BATCH &&
+		    (pvd = LIST_FIRST(&pp->pp_vdata)) != NULL) {
+			LIST_REMOVE(pvd, pvd_pidlink);
+			OSBitAndAtomic(~PVD_PIDLIST, &pvd->pvd_flags);
+			pfs_node_hold(pvd->pvd_pn);
+			pvds[n++] = pvd;
+		}
+		lck_mtx_unlock(lock);
+		for (i = 0; i < n; i++) {
+			pvd = pvds[i];
+			pn = pvd->pvd_pn;
+			vc = pvd->pvd_cache;
+			pfs_lock(pn);
+			lck_rw_lock_shared(vc->vc_tbllock);
+			if ((pvd->pvd_flags & PVD_NODELIST) != 0)
+				pfs_purge_entry(pvd);
+			lck_rw_unlock_shared(vc->vc_tbllock);
+			pfs_unlock(pn);
+			pfs_node_rele(pn);
+		}
+		pfs_vncache_read_exit(token);
+	} while (n == PFS_RECLAIM_BATCH);
+	FREE(pp, M_PFSVNCACHE);
+}
 
-	pid = p->p_pid;
-	hash = PFS_VNCACHE_HASH(pid);
-	if (SLIST_EMPTY(hash))
+static void
+pfs_exit_schedule(void)
+{
+	uint64_t deadline;
+
+	if (pfs_exit_stopping)
 		return;
-restart:
-	lck_mtx_lock(&pfs_vncache_mutex);
-	SLIST_FOREACH(pvd, hash, pvd_hash) {
-		if (pvd->pvd_pid != pid)
+	clock_interval_to_deadline(PFS_EXIT_INTERVAL, NSEC_PER_SEC, &deadline);
+	thread_call_enter_delayed(pfs_exit_call, deadline);
+}
+
+/*
+ * Purge the entries of every process that has exited since the last
+ * sweep.  A record chain covers pids that share a stripe lock, so chain i
+ * is under the lock of pid i.  The pids are copied out under the lock and
+ * looked up after it is dropped; a chain holding more than PFS_EXIT_BATCH
+ * records is finished by a later sweep.
+ */
+static void
+pfs_exit_sweep(thread_call_param_t arg0, thread_call_param_t arg1)
+{
+	pid_t pids[PFS_EXIT_BATCH];
+	struct pfs_vnpid *pp;
+	lck_mtx_t *lock;
+	struct proc *p;
+	u_long i;
+	int j, n;
+
+	for (i = 0; i <= pfs_vncache_pidhash; i++) {
+		if (LIST_EMPTY(&pfs_vncache_pidtbl[i]))
 			continue;
-		vnp = pvd->pvd_vnode;
-//		vhold(vnp);
-		lck_mtx_unlock(&pfs_vncache_mutex);
-		pfs_purge_one(vnp);
-		goto restart;
+		lock = PFS_VNCACHE_PIDLOCK(i);
+		n = 0;
+		lck_mtx_lock(lock);
+		LIST_FOREACH(pp, &pfs_vncache_pidtbl[i], pp_link) {
+			if (n == PFS_EXIT_BATCH)
+				break;
+			pids[n++] = pp->pp_pid;
+		}
+		lck_mtx_unlock(lock);
+		for (j = 0; j < n; j++) {
+			p = proc_find(pids[j]);
+			if (p != NULL)
+				proc_rele(p);
+			else
+				pfs_exit(pids[j]);
+		}
 	}
-	lck_mtx_unlock(&pfs_vncache_mutex);
+	pfs_exit_schedule();
 }
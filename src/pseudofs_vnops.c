@@ -73,9 +73,33 @@ __FBSDID("$FreeBSD$");
 
 /*
  * Returns the fileno, adjusted for target pid
+ *
+ * The node's own file number occupies the low 32 bits and the pid, plus
+ * one so that pid 0 differs from NO_PID, the bits above, so numbers are
+ * unique for any number of nodes and processes.  Static nodes keep their
+ * plain file number.
  */
-static uint32_t
+#define	PFS_FILENO_PIDSHIFT	32
+
+static uint64_t
 pn_fileno(struct pfs_node *pn, pid_t pid)
+{
+
+	KASSERT(pn->pn_fileno > 0,
+	    ("%s(): no fileno allocated", __func__));
+	if (pid != NO_PID)
+		return (((uint64_t)(pid + 1) << PFS_FILENO_PIDSHIFT) |
+		    pn->pn_fileno);
+	return (pn->pn_fileno);
+}
+
+/*
+ * Returns the fileno in the 32-bit encoding of struct dirent, which has
+ * no room for the pid above the node's number.  It wraps once a file
+ * system has more than UINT32_MAX / NO_PID nodes.
+ */
+static uint32_t
+pn_fileno32(struct pfs_node *pn, pid_t pid)
 {
 
 	KASSERT(pn->pn_fileno > 0,
@@ -119,6 +143,9 @@ pfs_visible(struct thread *td, struct pfs_node *pn, pid_t pid,
 
 	if (p)
 		*p = NULL;
+	/* destroyed nodes linger only until their vnodes are reclaimed */
+	if (pn->pn_dead)
+		PFS_RETURN (0);
 	if (pid == NO_PID)
 		PFS_RETURN (1);
 	proc = proc_find(pid);
@@ -192,9 +219,9 @@ pfs_close(struct vnop_close_args *va)
 
 	/*
 	 * Do nothing unless this is the last close and the node has a
-	 * last-close handler.
+	 * last-close handler, which is gone once the node is destroyed.
 	 */
-	if (vrefcnt(vn) > 1 || pn->pn_close == NULL)
+	if (vrefcnt(vn) > 1 || pn->pn_close == NULL || pn->pn_dead)
 		PFS_RETURN (0);
 
 	if (pvd->pvd_pid != NO_PID) {
@@ -569,17 +596,25 @@ pfs_lookup(struct vnop_cachedlookup_args *va)
 		goto got_pnode;
 	}
 
+	/*
+	 * Most names that do not exist are turned away by the filter
+	 * without taking the lock, unless they could be a pid.
+	 */
+	if (!pfs_bloom_test(pd, pfs_namehash(pname, namelen))) {
+		for (i = 0; i < namelen && isdigit(pname[i]); ++i)
+			continue;
+		if (i < namelen)
+			PFS_RETURN (ENOENT);
+	}
+
 	pfs_lock(pd);
 
 	/* named node */
-	for (pn = pd->pn_nodes; pn != NULL; pn = pn->pn_next)
-		if (pn->pn_type == pfstype_procdir)
-			pdn = pn;
-		else if (pn->pn_name[namelen] == '\0' &&
-		    bcmp(pname, pn->pn_name, namelen) == 0) {
-			pfs_unlock(pd);
-			goto got_pnode;
-		}
+	pn = pfs_find_child(pd, pname, namelen, &pdn);
+	if (pn != NULL && pn->pn_type != pfstype_procdir) {
+		pfs_unlock(pd);
+		goto got_pnode;
+	}
 
 	/* process dependent node */
 	if ((pn = pdn) != NULL) {
@@ -874,10 +909,18 @@ pfs_iterate(struct thread *td, struct proc *proc, struct pfs_node *pd,
 	return (0);
 }
 
-/* Directory entry list */
+/*
+ * Directory entry list.  Callers that ask for VNODE_READDIR_EXTENDED get
+ * a struct direntry, whose 64-bit d_ino can hold pn_fileno(); only its
+ * first PFS_DIRENTRYLEN bytes are kept.  The kernel only asks for them
+ * if the consumer registers its vfs_fsentry with VFS_TBLREADDIR_EXTENDED.
+ */
 struct pfsentry {
 	STAILQ_ENTRY(pfsentry)	link;
-	struct dirent		entry;
+	union {
+		struct dirent	d;
+		uint64_t	de[PFS_DIRENTRYLEN / sizeof(uint64_t)];
+	} entry;
 };
 STAILQ_HEAD(pfsdirentlist, pfsentry);
 
@@ -896,8 +939,12 @@ pfs_readdir(struct vnop_readdir_args *va)
 	struct uio *uio;
 	struct pfsentry *pfsent, *pfsent2;
 	struct pfsdirentlist lst;
+	struct direntry *de;
+	char name[PFS_NAMELEN];
 	off_t offset;
-	int error, i, resid;
+	pid_t fpid;
+	int delen, error, namlen, resid;
+	uint8_t type;
 	thread_t curthread = current_thread();
 
 	STAILQ_INIT(&lst);
@@ -911,12 +958,16 @@ pfs_readdir(struct vnop_readdir_args *va)
 		PFS_RETURN (ENOTDIR);
 	KASSERT_PN_IS_DIR(pd);
 	uio = va->a_uio;
+	if ((va->a_flags & VNODE_READDIR_EXTENDED) != 0)
+		delen = PFS_DIRENTRYLEN;
+	else
+		delen = PFS_DELEN;
 
 	/* only allow reading entire entries */
 	offset = uio->uio_offset;
 	resid = uio->uio_resid_64;
-	if (offset < 0 || offset % PFS_DELEN != 0 ||
-	    (resid && resid < PFS_DELEN))
+	if (offset < 0 || offset % delen != 0 ||
+	    (resid && resid < delen))
 		PFS_RETURN (EINVAL);
 	if (resid == 0)
 		PFS_RETURN (0);
@@ -945,7 +996,7 @@ pfs_readdir(struct vnop_readdir_args *va)
 	}
 
 	/* skip unwanted entries */
-	for (pn = NULL, p = NULL; offset > 0; offset -= PFS_DELEN) {
+	for (pn = NULL, p = NULL; offset > 0; offset -= delen) {
 		if (pfs_iterate(curthread, proc, pd, &pn, &p) == -1) {
 			/* nothing left... */
 			if (proc != NULL) {
@@ -960,47 +1011,62 @@ pfs_readdir(struct vnop_readdir_args *va)
 
 	/* fill in entries */
 	while (pfs_iterate(curthread, proc, pd, &pn, &p) != -1 &&
-	    resid >= PFS_DELEN) {
+	    resid >= delen) {
 		if ((pfsent = malloc(sizeof(struct pfsentry), M_IOV,
 		    M_NOWAIT | M_ZERO)) == NULL) {
 			error = ENOMEM;
 			break;
 		}
-		pfsent->entry.d_reclen = PFS_DELEN;
-		pfsent->entry.d_fileno = pn_fileno(pn, pid);
-		/* PFS_DELEN was picked to fit PFS_NAMLEN */
-		for (i = 0; i < PFS_NAMELEN - 1 && pn->pn_name[i] != '\0'; ++i)
-			pfsent->entry.d_name[i] = pn->pn_name[i];
-		pfsent->entry.d_namlen = i;
-		/* NOTE: d_off is the offset of the *next* entry. */
-//		pfsent->entry.d_off = offset + PFS_DELEN;
+		fpid = pid;
+		namlen = strlcpy(name, pn->pn_name, sizeof name);
 		switch (pn->pn_type) {
 		case pfstype_procdir:
 			KASSERT(p != NULL,
 			    ("reached procdir node with p == NULL"));
-			pfsent->entry.d_namlen = snprintf(pfsent->entry.d_name,
-			    PFS_NAMELEN, "%d", p->p_pid);
+			/* the number pfs_getattr() reports for the pid's vnode */
+			fpid = p->p_pid;
+			namlen = snprintf(name, sizeof name, "%d", p->p_pid);
 			/* fall through */
 		case pfstype_root:
 		case pfstype_dir:
 		case pfstype_this:
 		case pfstype_parent:
-			pfsent->entry.d_type = DT_DIR;
+			type = DT_DIR;
 			break;
 		case pfstype_file:
-			pfsent->entry.d_type = DT_REG;
+			type = DT_REG;
 			break;
 		case pfstype_symlink:
-			pfsent->entry.d_type = DT_LNK;
+			type = DT_LNK;
 			break;
 		default:
 			panic("%s has unexpected node type: %d", pn->pn_name, pn->pn_type);
 		}
-		PFS_TRACE(("%s", pfsent->entry.d_name));
-//		dirent_terminate(&pfsent->entry);
+		if (delen == PFS_DIRENTRYLEN) {
+			de = (struct direntry *)pfsent->entry.de;
+			de->d_ino = pn_fileno(pn, fpid);
+			/*
+			 * NOTE: d_seekoff is the offset of the *next* entry;
+			 * offset counts from where this read started.
+			 */
+			de->d_seekoff = uio->uio_offset + offset + delen;
+			de->d_reclen = delen;
+			de->d_namlen = namlen;
+			de->d_type = type;
+			bcopy(name, de->d_name, namlen);
+		} else {
+			/* struct dirent only has 32 bits */
+			pfsent->entry.d.d_fileno = pn_fileno32(pn, fpid);
+			pfsent->entry.d.d_reclen = delen;
+			pfsent->entry.d.d_namlen = namlen;
+			pfsent->entry.d.d_type = type;
+			/* PFS_DELEN was picked to fit PFS_NAMLEN */
+			bcopy(name, pfsent->entry.d.d_name, namlen);
+		}
+		PFS_TRACE(("%s", name));
 		STAILQ_INSERT_TAIL(&lst, pfsent, link);
-		offset += PFS_DELEN;
-		resid -= PFS_DELEN;
+		offset += delen;
+		resid -= delen;
 	}
 	if (proc != NULL) {
 		_PRELE(proc);
@@ -1008,14 +1074,12 @@ pfs_readdir(struct vnop_readdir_args *va)
 	}
 	pfs_unlock(pd);
 //	sx_sunlock(&allproc_lock);
-	i = 0;
 	STAILQ_FOREACH_SAFE(pfsent, &lst, link, pfsent2) {
 		if (error == 0)
-			error = uiomove(&pfsent->entry, PFS_DELEN, uio);
+			error = uiomove(&pfsent->entry, delen, uio);
 		FREE(pfsent, M_IOV);
-		i++;
 	}
-	PFS_TRACE(("%ju bytes", (uintmax_t)(i * PFS_DELEN)));
+	PFS_TRACE(("%ju bytes", (uintmax_t)offset));
 	PFS_RETURN (error);
 }
 
@@ -1044,6 +1108,8 @@ pfs_readlink(struct vnop_readlink_args *va)
 
 	if (pn->pn_fill == NULL)
 		PFS_RETURN (EIO);
+	if (pn->pn_dead)
+		PFS_RETURN (ENOENT);
 
 	if (pvd->pvd_pid != NO_PID) {
 		if ((proc = proc_find(pvd->pvd_pid)) == NULL)
@@ -1097,6 +1163,7 @@ pfs_reclaim(struct vnop_reclaim_args *va)
 	struct pfs_vdata *pvd = vn->v_data;
 	struct pfs_node *pn = pvd->pvd_pn;
 
+	/* the entry's reference keeps pn valid, even after pfs_destroy() */
 	PFS_TRACE(("%s", pn->pn_name));
 	pfs_assert_not_owned(pn);
 
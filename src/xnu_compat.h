@@ -21,6 +21,10 @@
 // Specific to pseudofs
 #define M_PFSVNCACHE                ENOTSUP
 
+// Specific to pseudofs - XNU has no kext-defined malloc types, so the
+// file number map is charged to M_TEMP like the rest of pseudofs_subr.c
+#define M_PFSFILENO                 M_TEMP
+
 // From FreeBSD sys/limits.h - redefined in accordance with XNU
 #define OFF_MAX                     LONG_MAX
 #define OFF_MIN                     LONG_MIN
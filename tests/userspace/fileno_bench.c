@@ -0,0 +1,370 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Test and benchmark for the pseudofs file number allocator.
+ *
+ * The allocator is built from src/pseudofs_fileno.c as is, on top of the
+ * userspace runtime in pfs_userspace.c.  The program runs four phases:
+ *
+ * exhaust	Every number is allocated once.  They must all be distinct
+ *		and in range, the map must then be empty, and after they
+ *		have all been released the map must be back to its initial
+ *		state.
+ *
+ * throughput	Each thread keeps a set of live nodes and replaces a random
+ *		one with a new node in a loop, for each thread count in
+ *		turn.  The nodes cycle through the per-CPU slots.  The rate
+ *		of allocate/release pairs is reported.
+ *
+ * fragmentation
+ *		A large population is churned at random, and the highest
+ *		number in use is compared with the number of live nodes.
+ *		New nodes are then added, and the share of them that fill
+ *		holes below that highest number is reported.
+ *
+ * stable	With vfs.pfs.stable_filenos set, nodes are numbered from a
+ *		hash of their path.  The share of nodes that got exactly
+ *		their hashed number, and the same numbers again after the
+ *		tree is rebuilt, are reported.
+ *
+ * Usage: fileno_bench [-d msec] [-t maxthreads]
+ */
+
+#include "pseudofs_fileno.c"
+
+#define TEST_LIVE	1024		/* live nodes per thread */
+#define TEST_FRAGLIVE	(PFS_FILENO_LIMIT / 4)
+#define TEST_STABLE	10000
+#define TEST_HOLES	4096
+
+int maxproc = 1024;
+
+static struct pfs_info test_info = { "pfstest" };
+static struct pfs_node test_root;
+static volatile int test_stop;
+
+static uint32_t
+test_random(uint64_t *state)
+{
+
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return ((uint32_t)(*state >> 16));
+}
+
+static uint64_t
+test_now_ns(void)
+{
+
+	return (mach_absolute_time());
+}
+
+static struct pfs_node *
+test_nodes_alloc(int n)
+{
+	struct pfs_node *nodes;
+	int i;
+
+	nodes = pfs_us_malloc(n * sizeof *nodes, M_WAITOK);
+	for (i = 0; i < n; i++) {
+		lck_mtx_init(nodes[i].pn_mutex, NULL, LCK_SLEEP_DEFAULT);
+		snprintf(nodes[i].pn_name, sizeof nodes[i].pn_name, "%d", i);
+		nodes[i].pn_type = pfstype_file;
+		nodes[i].pn_info = &test_info;
+		nodes[i].pn_parent = &test_root;
+	}
+	return (nodes);
+}
+
+static void
+test_nodes_free(struct pfs_node *nodes, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		lck_mtx_destroy(nodes[i].pn_mutex, NULL);
+	free(nodes);
+}
+
+/*
+ * Return the numbers the CPU slots hold to the map, and check that the
+ * map has every number free, as a fresh one does.
+ */
+static void
+test_check_full(void)
+{
+	struct pfs_bitmap *pb, *fresh;
+	struct pfs_filenocpu *fc;
+	int i;
+
+	pb = test_info.pi_bitmap;
+	for (i = 0; i < PFS_FILENO_NCPU; i++) {
+		fc = &pb->pb_cpu[i];
+		while (fc->fc_count > 0)
+			pfs_bitmap_free(pb, fc->fc_nums[--fc->fc_count]);
+	}
+	fresh = pfs_bitmap_create(pb->pb_limit);
+	KASSERT(pb->pb_top == fresh->pb_top, ("top word differs"));
+	KASSERT(memcmp(pb->pb_summary, fresh->pb_summary,
+	    pb->pb_nsummary * sizeof(uint64_t)) == 0,
+	    ("summary words differ"));
+	KASSERT(memcmp(pb->pb_leaves, fresh->pb_leaves,
+	    pb->pb_nleaves * sizeof(uint64_t)) == 0, ("leaf words differ"));
+	pfs_bitmap_destroy(fresh);
+}
+
+static void
+test_exhaust(void)
+{
+	struct pfs_node *nodes, extra;
+	uint8_t *seen;
+	uint64_t t0, t1;
+	int i, n;
+
+	n = PFS_FILENO_LIMIT - PFS_FILENO_FIRST;
+	nodes = test_nodes_alloc(n);
+	seen = pfs_us_malloc(PFS_FILENO_LIMIT, M_WAITOK);
+	t0 = test_now_ns();
+	for (i = 0; i < n; i++)
+		pfs_fileno_alloc(&nodes[i]);
+	t1 = test_now_ns();
+	for (i = 0; i < n; i++) {
+		KASSERT(nodes[i].pn_fileno >= PFS_FILENO_FIRST &&
+		    nodes[i].pn_fileno < PFS_FILENO_LIMIT,
+		    ("file number %u out of range", nodes[i].pn_fileno));
+		KASSERT(!seen[nodes[i].pn_fileno],
+		    ("file number %u handed out twice", nodes[i].pn_fileno));
+		seen[nodes[i].pn_fileno] = 1;
+	}
+
+	/* the map is exhausted: one more node gets no number, and a warning */
+	memset(&extra, 0, sizeof extra);
+	lck_mtx_init(extra.pn_mutex, NULL, LCK_SLEEP_DEFAULT);
+	strcpy(extra.pn_name, "extra");
+	extra.pn_type = pfstype_file;
+	extra.pn_info = &test_info;
+	extra.pn_parent = &test_root;
+	pfs_fileno_alloc(&extra);
+	KASSERT(extra.pn_fileno == 0, ("got %u from a full map",
+	    extra.pn_fileno));
+	lck_mtx_destroy(extra.pn_mutex, NULL);
+
+	for (i = 0; i < n; i++)
+		pfs_fileno_free(&nodes[i]);
+	test_check_full();
+	printf("exhaust:  %d numbers in %.1f ns each, all distinct\n", n,
+	    (double)(t1 - t0) / n);
+	free(seen);
+	test_nodes_free(nodes, n);
+}
+
+struct test_worker {
+	pthread_t	 tw_thread;
+	uint64_t	 tw_seed;
+	uint64_t	 tw_ops;
+	struct pfs_node	*tw_nodes;
+};
+
+static void *
+test_worker_main(void *arg)
+{
+	struct test_worker *tw;
+	struct pfs_node *pn;
+
+	tw = arg;
+	while (!test_stop) {
+		pn = &tw->tw_nodes[test_random(&tw->tw_seed) % TEST_LIVE];
+		pfs_fileno_free(pn);
+		pfs_fileno_alloc(pn);
+		KASSERT(pn->pn_fileno != 0, ("out of file numbers"));
+		tw->tw_ops++;
+	}
+	return (NULL);
+}
+
+static void
+test_throughput(int maxthreads, int msec)
+{
+	struct test_worker *tw;
+	uint64_t ops, t0, t1;
+	int i, j, n;
+
+	tw = pfs_us_malloc(maxthreads * sizeof *tw, M_WAITOK);
+	for (i = 0; i < maxthreads; i++) {
+		tw[i].tw_nodes = test_nodes_alloc(TEST_LIVE);
+		for (j = 0; j < TEST_LIVE; j++)
+			pfs_fileno_alloc(&tw[i].tw_nodes[j]);
+	}
+	printf("%8s %14s\n", "threads", "pairs/s");
+	for (n = 1; n <= maxthreads; n *= 2) {
+		test_stop = 0;
+		t0 = test_now_ns();
+		for (i = 0; i < n; i++) {
+			tw[i].tw_seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+			tw[i].tw_ops = 0;
+			if (pthread_create(&tw[i].tw_thread, NULL,
+			    test_worker_main, &tw[i]) != 0)
+				panic("pthread_create");
+		}
+		usleep(msec * 1000);
+		test_stop = 1;
+		ops = 0;
+		for (i = 0; i < n; i++) {
+			pthread_join(tw[i].tw_thread, NULL);
+			ops += tw[i].tw_ops;
+		}
+		t1 = test_now_ns();
+		printf("%8d %14.0f\n", n, ops * 1e9 / (double)(t1 - t0));
+	}
+	for (i = 0; i < maxthreads; i++) {
+		for (j = 0; j < TEST_LIVE; j++)
+			pfs_fileno_free(&tw[i].tw_nodes[j]);
+		test_nodes_free(tw[i].tw_nodes, TEST_LIVE);
+	}
+	free(tw);
+	test_check_full();
+}
+
+static void
+test_fragmentation(void)
+{
+	struct pfs_node *nodes, *more;
+	uint64_t seed;
+	u_int max;
+	int holes, i, r;
+
+	nodes = test_nodes_alloc(2 * TEST_FRAGLIVE);
+	for (i = 0; i < 2 * TEST_FRAGLIVE; i++)
+		pfs_fileno_alloc(&nodes[i]);
+	/* free a random half, then churn */
+	seed = 0xdeadbeefcafef00dULL;
+	for (i = 0; i < TEST_FRAGLIVE; i++) {
+		r = test_random(&seed) % (2 * TEST_FRAGLIVE);
+		while (nodes[r].pn_fileno == 0)
+			r = (r + 1) % (2 * TEST_FRAGLIVE);
+		pfs_fileno_free(&nodes[r]);
+	}
+	for (i = 0; i < 8 * TEST_FRAGLIVE; i++) {
+		r = test_random(&seed) % (2 * TEST_FRAGLIVE);
+		if (nodes[r].pn_fileno != 0)
+			pfs_fileno_free(&nodes[r]);
+		else
+			pfs_fileno_alloc(&nodes[r]);
+	}
+	r = 0;
+	max = 0;
+	for (i = 0; i < 2 * TEST_FRAGLIVE; i++) {
+		if (nodes[i].pn_fileno == 0)
+			continue;
+		r++;
+		max = MAX(max, nodes[i].pn_fileno);
+	}
+	more = test_nodes_alloc(TEST_HOLES);
+	holes = 0;
+	for (i = 0; i < TEST_HOLES; i++) {
+		pfs_fileno_alloc(&more[i]);
+		if (more[i].pn_fileno < max)
+			holes++;
+	}
+	printf("fragment: %d live nodes, highest number %u (%.1f%% dense), "
+	    "%.1f%% of new numbers fill holes\n", r, max,
+	    100.0 * r / (max - PFS_FILENO_FIRST + 1),
+	    100.0 * holes / TEST_HOLES);
+	for (i = 0; i < TEST_HOLES; i++)
+		pfs_fileno_free(&more[i]);
+	test_nodes_free(more, TEST_HOLES);
+	for (i = 0; i < 2 * TEST_FRAGLIVE; i++)
+		pfs_fileno_free(&nodes[i]);
+	test_nodes_free(nodes, 2 * TEST_FRAGLIVE);
+	test_check_full();
+}
+
+static void
+test_stable(void)
+{
+	struct pfs_node *nodes;
+	u_int *first, want;
+	int exact, i;
+
+	pfs_fileno_uninit(&test_info);
+	pfs_fileno_stable = 1;
+	pfs_fileno_init(&test_info);
+
+	nodes = test_nodes_alloc(TEST_STABLE);
+	first = pfs_us_malloc(TEST_STABLE * sizeof *first, M_WAITOK);
+	exact = 0;
+	for (i = 0; i < TEST_STABLE; i++) {
+		pfs_fileno_alloc(&nodes[i]);
+		want = PFS_FILENO_FIRST + pfs_fileno_pathhash(&nodes[i]) %
+		    (PFS_FILENO_LIMIT - PFS_FILENO_FIRST);
+		if (nodes[i].pn_fileno == want)
+			exact++;
+		first[i] = nodes[i].pn_fileno;
+	}
+	/* tear the tree down and build it again in the same order */
+	for (i = 0; i < TEST_STABLE; i++)
+		pfs_fileno_free(&nodes[i]);
+	test_check_full();
+	for (i = 0; i < TEST_STABLE; i++) {
+		pfs_fileno_alloc(&nodes[i]);
+		KASSERT(nodes[i].pn_fileno == first[i],
+		    ("node %d got %u, then %u", i, first[i],
+		    nodes[i].pn_fileno));
+	}
+	printf("stable:   %d nodes, %.2f%% at their hashed number, same "
+	    "numbers after a rebuild\n", TEST_STABLE,
+	    100.0 * exact / TEST_STABLE);
+	for (i = 0; i < TEST_STABLE; i++)
+		pfs_fileno_free(&nodes[i]);
+	test_check_full();
+	free(first);
+	test_nodes_free(nodes, TEST_STABLE);
+	pfs_fileno_stable = 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	long ncpu;
+	int ch, maxthreads, msec;
+
+	msec = 500;
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	maxthreads = ncpu > 1 ? (int)ncpu : 2;
+	while ((ch = getopt(argc, argv, "d:t:")) != -1) {
+		switch (ch) {
+		case 'd':
+			msec = atoi(optarg);
+			break;
+		case 't':
+			maxthreads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+			    "usage: fileno_bench [-d msec] [-t maxthreads]\n");
+			return (1);
+		}
+	}
+	if (msec <= 0 || maxthreads <= 0)
+		return (1);
+
+	lck_mtx_init(test_root.pn_mutex, NULL, LCK_SLEEP_DEFAULT);
+	test_root.pn_type = pfstype_root;
+	test_root.pn_info = &test_info;
+	test_info.pi_root = &test_root;
+	pfs_fileno_init(&test_info);
+	KASSERT((uintptr_t)test_info.pi_bitmap->pb_cpu %
+	    __alignof__(struct pfs_filenocpu) == 0,
+	    ("CPU slots are not cache line aligned"));
+
+	test_exhaust();
+	test_throughput(maxthreads, msec);
+	test_fragmentation();
+	test_stable();
+
+	pfs_fileno_uninit(&test_info);
+	lck_mtx_destroy(test_root.pn_mutex, NULL);
+	printf("ok\n");
+	return (0);
+}
@@ -0,0 +1,2 @@
+/* Userspace build; see pfs_userspace.h. */
+#include "pfs_userspace.h"
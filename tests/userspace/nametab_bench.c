@@ -0,0 +1,213 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Benchmark for directory lookups in small pseudofs directories.
+ *
+ * Trees are built with pfs_create_file() from src/pseudofs_vfsops.c as
+ * is, on top of the userspace runtime in pfs_userspace.c.  Directories
+ * below PFS_INDEX_MIN children keep a packed name table, and
+ * pfs_find_child() scans it; with the table detached, the same call falls
+ * back to walking the list of children.  For each directory size, both
+ * are timed on the same trees, for names that exist and for names that
+ * do not, and must return the same node every time.
+ *
+ * Many directories are built side by side and looked up in random order,
+ * so that, as in a real tree, the children of one directory are not next
+ * to each other in memory and the scan does not run from the L1 cache.
+ *
+ * Usage: nametab_bench [-n lookups]
+ */
+
+#include <kern/locks.h>
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+
+#include "pseudofs.h"
+#include "pseudofs_internal.h"
+
+#define TEST_NDIRS	1024
+#define TEST_NAMES	(PFS_INDEX_MIN - 3)	/* leave room for . and .. */
+
+int maxproc = 1024;
+
+void	pfs_vncache_load(void);
+void	pfs_vncache_unload(void);
+
+static int
+test_init(PFS_INIT_ARGS)
+{
+
+	return (0);
+}
+
+static struct pfs_info test_info = { "pfstest", test_init, test_init };
+static struct pfs_node *test_dirs[TEST_NDIRS];
+static char test_names[2 * TEST_NAMES][PFS_NAMELEN];
+
+static uint32_t
+test_random(uint64_t *state)
+{
+
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return ((uint32_t)(*state >> 16));
+}
+
+static uint64_t
+test_now_ns(void)
+{
+
+	return (mach_absolute_time());
+}
+
+/*
+ * Names as a process directory has them: short ones that fit in the
+ * prefix, and longer ones that share their first bytes.  The second half
+ * are never created, and are looked up as misses.
+ */
+static void
+test_names_init(void)
+{
+	static const char *base[] = {
+		"status", "cmdline", "mem", "environ", "file", "map", "rlimit",
+		"osrel", "dbregs", "fpregs", "regs", "note", "notepg",
+	};
+	int i;
+
+	for (i = 0; i < 2 * TEST_NAMES; i++) {
+		if (i % 3 == 2)
+			snprintf(test_names[i], PFS_NAMELEN,
+			    "process_resource_limit_%d", i);
+		else
+			snprintf(test_names[i], PFS_NAMELEN, "%s%d",
+			    base[i % nitems(base)], i);
+	}
+}
+
+/*
+ * Look up names in random directories, through the name table or, with
+ * the tables detached, the list.  Returns ns per lookup.
+ */
+static double
+test_lookups(int size, int first, int nlookups, int uselist,
+    struct pfs_node **found)
+{
+	struct pfs_nametab *saved[TEST_NDIRS];
+	struct pfs_node *pd, *pdn, *pn;
+	uint64_t seed, t0, t1;
+	uint32_t r;
+	int d, i, k;
+
+	if (uselist)
+		for (d = 0; d < TEST_NDIRS; d++) {
+			saved[d] = test_dirs[d]->pn_names;
+			test_dirs[d]->pn_names = NULL;
+		}
+	seed = 0x9e3779b97f4a7c15ULL;
+	t0 = test_now_ns();
+	for (i = 0; i < nlookups; i++) {
+		r = test_random(&seed);
+		d = r % TEST_NDIRS;
+		k = first + (r >> 16) % size;
+		pd = test_dirs[d];
+		pfs_lock(pd);
+		pn = pfs_find_child(pd, test_names[k], strlen(test_names[k]),
+		    &pdn);
+		pfs_unlock(pd);
+		if (found[i] == (struct pfs_node *)-1)
+			found[i] = pn;
+		else
+			KASSERT(found[i] == pn, ("lookup of %s in %d: %p, "
+			    "then %p", test_names[k], d, found[i], pn));
+	}
+	t1 = test_now_ns();
+	if (uselist)
+		for (d = 0; d < TEST_NDIRS; d++)
+			test_dirs[d]->pn_names = saved[d];
+	return ((double)(t1 - t0) / nlookups);
+}
+
+static void
+test_size(int size, int nlookups)
+{
+	struct pfs_node **found;
+	double hitlist, hittab, misslist, misstab;
+	int d, i;
+	char name[PFS_NAMELEN];
+
+	/* build the directories a child at a time, round robin */
+	for (d = 0; d < TEST_NDIRS; d++) {
+		snprintf(name, sizeof name, "dir%d", d);
+		test_dirs[d] = pfs_create_dir(test_info.pi_root, name, NULL,
+		    NULL, NULL, 0);
+	}
+	for (i = 0; i < size; i++)
+		for (d = 0; d < TEST_NDIRS; d++)
+			pfs_create_file(test_dirs[d], test_names[i], NULL,
+			    NULL, NULL, NULL, 0);
+	for (d = 0; d < TEST_NDIRS; d++)
+		KASSERT(test_dirs[d]->pn_names != NULL &&
+		    test_dirs[d]->pn_index == NULL,
+		    ("directory %d is not using a name table", d));
+
+	found = pfs_us_malloc(nlookups * sizeof *found, M_WAITOK);
+	for (i = 0; i < nlookups; i++)
+		found[i] = (struct pfs_node *)-1;
+	hitlist = test_lookups(size, 0, nlookups, 1, found);
+	hittab = test_lookups(size, 0, nlookups, 0, found);
+	for (i = 0; i < nlookups; i++) {
+		KASSERT(found[i] != NULL, ("existing name not found"));
+		found[i] = (struct pfs_node *)-1;
+	}
+	misslist = test_lookups(size, TEST_NAMES, nlookups, 1, found);
+	misstab = test_lookups(size, TEST_NAMES, nlookups, 0, found);
+	for (i = 0; i < nlookups; i++)
+		KASSERT(found[i] == NULL, ("missing name found"));
+	free(found);
+
+	printf("%8d %10.1f %10.1f %8.2fx %10.1f %10.1f %8.2fx\n",
+	    size + 2, hitlist, hittab, hitlist / hittab, misslist, misstab,
+	    misslist / misstab);
+
+	for (d = 0; d < TEST_NDIRS; d++)
+		pfs_destroy(test_dirs[d]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int sizes[] = { 2, 4, 8, 16, 24, TEST_NAMES };
+	int ch, i, nlookups;
+
+	nlookups = 500000;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nlookups = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: nametab_bench [-n lookups]\n");
+			return (1);
+		}
+	}
+	if (nlookups <= 0)
+		return (1);
+
+	test_names_init();
+	pfs_vncache_load();
+	if (pfs_init(&test_info, NULL) != 0)
+		panic("pfs_init");
+
+	printf("%8s %10s %10s %9s %10s %10s %9s\n", "children", "hit list",
+	    "hit table", "", "miss list", "miss table", "");
+	for (i = 0; i < (int)nitems(sizes); i++)
+		test_size(sizes[i], nlookups);
+
+	pfs_uninit(&test_info, NULL);
+	pfs_vncache_unload();
+	printf("ok\n");
+	return (0);
+}
@@ -0,0 +1,301 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Userspace runtime for the pseudofs test programs: sleep queues, kernel
+ * threads and an emulation of the vnode life cycle.
+ *
+ * A vnode is created with an I/O reference.  vnode_recycle() marks it,
+ * and the last reference dropped on a marked vnode reclaims it, which
+ * calls pfs_vncache_free() as pfs_reclaim() does.  A reclaimed vnode gets
+ * a new vid and goes on a free list for reuse; its memory is never
+ * released, so that vnode_getwithvid() on a stale pointer is always safe
+ * and always fails.
+ */
+
+#include "pfs_userspace.h"
+
+/* only programs built with the vnode cache create vnodes with data */
+int	pfs_vncache_free(struct vnode *) __attribute__((weak));
+
+pthread_mutex_t pfs_us_sleeplock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pfs_us_sleepcv = PTHREAD_COND_INITIALIZER;
+unsigned long pfs_us_sleepgen;
+
+struct pfs_us_thread {
+	void		(*ut_func)(void *, wait_result_t);
+	void		*ut_arg;
+};
+
+static void *
+pfs_us_thread_main(void *arg)
+{
+	struct pfs_us_thread ut;
+
+	ut = *(struct pfs_us_thread *)arg;
+	free(arg);
+	ut.ut_func(ut.ut_arg, 0);
+	return (NULL);
+}
+
+kern_return_t
+kernel_thread_start(void (*func)(void *, wait_result_t), void *arg,
+    thread_t *threadp)
+{
+	struct pfs_us_thread *ut;
+
+	ut = pfs_us_malloc(sizeof *ut, M_WAITOK);
+	ut->ut_func = func;
+	ut->ut_arg = arg;
+	if (pthread_create(threadp, NULL, pfs_us_thread_main, ut) != 0) {
+		free(ut);
+		return (-1);
+	}
+	return (KERN_SUCCESS);
+}
+
+/*
+ * Vnodes
+ */
+#define VS_ACTIVE	0	/* usable */
+#define VS_MARKED	1	/* reclaim on last reference */
+#define VS_RECLAIM	2	/* being reclaimed */
+#define VS_FREE		3	/* reclaimed, on the free list */
+
+static pthread_mutex_t pfs_us_vnodelock = PTHREAD_MUTEX_INITIALIZER;
+static struct vnode *pfs_us_vnodefree;
+static uint32_t pfs_us_nextvid;
+long pfs_us_vnodes;		/* vnodes ever allocated */
+long pfs_us_reclaims;		/* vnodes reclaimed */
+
+static struct vnode *
+pfs_us_vnode_alloc(int state)
+{
+	struct vnode *vp;
+
+	pthread_mutex_lock(&pfs_us_vnodelock);
+	vp = pfs_us_vnodefree;
+	if (vp != NULL)
+		pfs_us_vnodefree = vp->v_freelink;
+	pthread_mutex_unlock(&pfs_us_vnodelock);
+	if (vp == NULL) {
+		vp = pfs_us_malloc(sizeof *vp, M_WAITOK);
+		pthread_mutex_init(&vp->v_mtx, NULL);
+		__atomic_fetch_add(&pfs_us_vnodes, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_lock(&vp->v_mtx);
+	vp->v_id = __atomic_add_fetch(&pfs_us_nextvid, 1, __ATOMIC_RELAXED);
+	vp->v_iocount = 1;
+	vp->v_usecount = 0;
+	vp->v_state = state;
+	vp->v_flag = 0;
+	vp->v_type = VNON;
+	vp->v_mount = NULL;
+	vp->v_data = NULL;
+	pthread_mutex_unlock(&vp->v_mtx);
+	return (vp);
+}
+
+/*
+ * Called with the vnode lock held; drops it.
+ */
+static void
+pfs_us_vnode_release(struct vnode *vp)
+{
+
+	if (vp->v_iocount > 0 || vp->v_usecount > 0 ||
+	    vp->v_state != VS_MARKED) {
+		pthread_mutex_unlock(&vp->v_mtx);
+		return;
+	}
+	vp->v_state = VS_RECLAIM;
+	pthread_mutex_unlock(&vp->v_mtx);
+	if (vp->v_data != NULL)
+		pfs_vncache_free(vp);
+	KASSERT(vp->v_data == NULL, ("vnode %p reclaimed with data", vp));
+	__atomic_fetch_add(&pfs_us_reclaims, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&vp->v_mtx);
+	vp->v_id = __atomic_add_fetch(&pfs_us_nextvid, 1, __ATOMIC_RELAXED);
+	vp->v_state = VS_FREE;
+	pthread_mutex_unlock(&vp->v_mtx);
+	pthread_mutex_lock(&pfs_us_vnodelock);
+	vp->v_freelink = pfs_us_vnodefree;
+	pfs_us_vnodefree = vp;
+	pthread_mutex_unlock(&pfs_us_vnodelock);
+}
+
+/*
+ * Empty vnodes are marked, so that dropping them unused reclaims them.
+ */
+int
+vnode_create_empty(struct vnode **vpp)
+{
+
+	*vpp = pfs_us_vnode_alloc(VS_MARKED);
+	return (0);
+}
+
+/*
+ * What pfs_getnewvnode() does with vnode_create() and vnode_initialize().
+ */
+int
+pfs_getnewvnode(struct mount *mp, struct vnode *lowervp, struct vnode *dvp,
+    struct vnode **vpp, struct componentname *cnp, int root, void *fsnode)
+{
+	struct vnode *vp;
+
+	vp = *vpp;
+	if (vp == NULLVP)
+		vp = pfs_us_vnode_alloc(VS_ACTIVE);
+	pthread_mutex_lock(&vp->v_mtx);
+	vp->v_state = VS_ACTIVE;
+	vp->v_mount = mp;
+	vp->v_data = fsnode;
+	pthread_mutex_unlock(&vp->v_mtx);
+	*vpp = vp;
+	return (0);
+}
+
+int
+vnode_getwithvid(struct vnode *vp, uint32_t vid)
+{
+
+	pthread_mutex_lock(&vp->v_mtx);
+	if (vp->v_id != vid || vp->v_state != VS_ACTIVE) {
+		pthread_mutex_unlock(&vp->v_mtx);
+		return (ENOENT);
+	}
+	vp->v_iocount++;
+	pthread_mutex_unlock(&vp->v_mtx);
+	return (0);
+}
+
+uint32_t
+vnode_vid(struct vnode *vp)
+{
+
+	return (vp->v_id);
+}
+
+int
+vnode_put(struct vnode *vp)
+{
+
+	pthread_mutex_lock(&vp->v_mtx);
+	KASSERT(vp->v_iocount > 0, ("vnode_put(%p): no I/O reference", vp));
+	vp->v_iocount--;
+	pfs_us_vnode_release(vp);
+	return (0);
+}
+
+int
+vnode_ref(struct vnode *vp)
+{
+
+	pthread_mutex_lock(&vp->v_mtx);
+	KASSERT(vp->v_iocount > 0, ("vnode_ref(%p): no I/O reference", vp));
+	vp->v_usecount++;
+	pthread_mutex_unlock(&vp->v_mtx);
+	return (0);
+}
+
+void
+vnode_rele(struct vnode *vp)
+{
+
+	pthread_mutex_lock(&vp->v_mtx);
+	KASSERT(vp->v_usecount > 0, ("vnode_rele(%p): no use reference", vp));
+	vp->v_usecount--;
+	pfs_us_vnode_release(vp);
+}
+
+int
+vnode_recycle(struct vnode *vp)
+{
+
+	pthread_mutex_lock(&vp->v_mtx);
+	if (vp->v_state == VS_ACTIVE)
+		vp->v_state = VS_MARKED;
+	pfs_us_vnode_release(vp);
+	return (0);
+}
+
+int
+vnode_isinuse(struct vnode *vp, int refcnt)
+{
+
+	return (__atomic_load_n(&vp->v_usecount, __ATOMIC_RELAXED) > refcnt);
+}
+
+void
+cache_purge(struct vnode *vp)
+{
+}
+
+/*
+ * Mounts
+ */
+size_t
+pfs_us_strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len;
+
+	len = strlen(src);
+	if (size > 0) {
+		if (len >= size)
+			size--;
+		else
+			size = len;
+		memcpy(dst, src, size);
+		dst[size] = '\0';
+	}
+	return (len);
+}
+
+int
+copystr(const void *src, void *dst, size_t maxlen, size_t *lencopied)
+{
+	size_t len;
+
+	len = strnlen(src, maxlen);
+	if (len == maxlen)
+		return (ENAMETOOLONG);
+	memcpy(dst, src, len + 1);
+	if (lencopied != NULL)
+		*lencopied = len + 1;
+	return (0);
+}
+
+struct statfs *
+vfs_statfs(struct mount *mp)
+{
+
+	return (&mp->mnt_vfsstat);
+}
+
+void
+vfs_getnewfsid(struct mount *mp)
+{
+}
+
+vfs_context_t
+vfs_context_kernel(void)
+{
+
+	return (NULL);
+}
+
+int
+kernel_mount(char *fstype, struct vnode *pvp, struct vnode *vp,
+    const char *path, void *data, size_t datalen, int syscall_flags,
+    uint32_t kern_flags, vfs_context_t ctx)
+{
+
+	return (ENOTSUP);
+}
+
+int
+vflush(struct mount *mp, struct vnode *skipvp, int flags)
+{
+
+	return (ENOTSUP);
+}
@@ -0,0 +1,501 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Userspace stand-ins for the XNU kernel interfaces used by pseudofs, so
+ * that its caches and allocators can be built and exercised on a plain
+ * POSIX system.  The test programs include the kernel sources directly;
+ * this header is forced in ahead of them (see the Makefile), and the
+ * headers under include/ only pull it in.
+ *
+ * Locks are pthread mutexes and rwlocks, atomics are compiler builtins
+ * with sequentially consistent ordering, kernel threads are pthreads, and
+ * msleep()/wakeup() share a single condition variable.  Vnodes are
+ * emulated by pfs_userspace.c: they are never freed, only recycled with a new
+ * vid, as in XNU, so that a stale pointer can always be checked with
+ * vnode_getwithvid().
+ */
+
+#ifndef _PFS_USERSPACE_H
+#define _PFS_USERSPACE_H
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef nitems
+#define nitems(x)		(sizeof((x)) / sizeof((x)[0]))
+#endif
+
+/* the real compatibility header needs the kernel SDK */
+#define _XNU_COMPAT_H
+
+#define __FBSDID(s)		struct __hack
+
+#ifndef LIST_FOREACH_SAFE
+#define LIST_FOREACH_SAFE(var, head, field, tvar)			\
+	for ((var) = LIST_FIRST((head));				\
+	    (var) && ((tvar) = LIST_NEXT((var), field), 1);		\
+	    (var) = (tvar))
+#endif
+#ifndef TAILQ_FOREACH_SAFE
+#define TAILQ_FOREACH_SAFE(var, head, field, tvar)			\
+	for ((var) = TAILQ_FIRST((head));				\
+	    (var) && ((tvar) = TAILQ_NEXT((var), field), 1);		\
+	    (var) = (tvar))
+#endif
+
+typedef int32_t			SInt32;
+typedef uint32_t		UInt32;
+typedef int64_t			SInt64;
+typedef uint64_t		UInt64;
+typedef uint64_t		user_addr_t;
+typedef int			wait_result_t;
+typedef int			kern_return_t;
+typedef pthread_t		thread_t;
+
+#define KERN_SUCCESS		0
+#define PVFS			0
+#define NO_PID			100000
+#define MFSNAMELEN		15
+
+extern int maxproc;
+
+/*
+ * Diagnostics
+ */
+#define panic(...) do {							\
+	fflush(stdout);							\
+	fprintf(stderr, "panic: " __VA_ARGS__);				\
+	fprintf(stderr, "\n");						\
+	abort();							\
+} while (0)
+
+#define KASSERT(exp, msg) do {						\
+	if (!(exp)) {							\
+		fflush(stdout);						\
+		fprintf(stderr, "%s:%d: assertion failed: ",		\
+		    __FILE__, __LINE__);				\
+		printf msg;						\
+		printf("\n");						\
+		fflush(stdout);						\
+		abort();						\
+	}								\
+} while (0)
+
+/*
+ * Memory
+ */
+#define M_WAITOK		0x0001
+#define M_NOWAIT		0x0002
+#define M_ZERO			0x0100
+
+#define MALLOC_DEFINE(type, shortdesc, longdesc)			\
+	int type##_malloc_type __attribute__((unused))
+
+static inline void *
+pfs_us_malloc(size_t size, int flags)
+{
+	void *p;
+
+	p = calloc(1, size);
+	if (p == NULL && (flags & M_NOWAIT) == 0)
+		panic("out of memory");
+	return (p);
+}
+
+#define malloc(size, type, flags)	pfs_us_malloc((size), (flags))
+#define FREE(addr, type)		free(addr)
+
+static inline void *
+pfs_us_hashinit(int elements, u_long *hashmask)
+{
+	u_long hashsize;
+
+	for (hashsize = 1; hashsize <= (u_long)elements; hashsize <<= 1)
+		continue;
+	hashsize >>= 1;
+	*hashmask = hashsize - 1;
+	return (pfs_us_malloc(hashsize * sizeof(void *), M_WAITOK));
+}
+
+#define hashinit(elements, type, hashmask) \
+	pfs_us_hashinit((elements), (hashmask))
+
+/*
+ * Atomics
+ */
+#define OSIncrementAtomic(p)	__atomic_fetch_add((p), 1, __ATOMIC_SEQ_CST)
+#define OSDecrementAtomic(p)	__atomic_fetch_sub((p), 1, __ATOMIC_SEQ_CST)
+#define OSAddAtomic(v, p)	__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define OSAddAtomic64(v, p)	__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define OSIncrementAtomic64(p)	__atomic_fetch_add((p), 1, __ATOMIC_SEQ_CST)
+#define OSIncrementAtomicLong(p) __atomic_fetch_add((p), 1, __ATOMIC_SEQ_CST)
+#define OSBitOrAtomic(m, p)	__atomic_fetch_or((p), (m), __ATOMIC_SEQ_CST)
+#define OSBitAndAtomic(m, p)	__atomic_fetch_and((p), (m), __ATOMIC_SEQ_CST)
+#define OSMemoryBarrier()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * Locks.  The kernel sources keep pointers to their locks and let
+ * lck_mtx_init() and lck_rw_init() fill them in.
+ */
+#define LCK_SLEEP_DEFAULT	0
+#define MTX_DUPOK		0
+#define LCK_MTX_ASSERT_OWNED	1
+#define LCK_MTX_ASSERT_NOTOWNED	2
+
+typedef struct {
+	pthread_mutex_t		 lm_mtx;
+	pthread_t		 lm_owner;
+	int			 lm_held;
+} lck_mtx_t;
+
+typedef struct {
+	pthread_rwlock_t	 lr_rw;
+} lck_rw_t;
+
+static inline lck_mtx_t *
+pfs_us_mtx_alloc(void)
+{
+	lck_mtx_t *m;
+
+	m = pfs_us_malloc(sizeof *m, M_WAITOK);
+	pthread_mutex_init(&m->lm_mtx, NULL);
+	return (m);
+}
+
+static inline lck_rw_t *
+pfs_us_rw_alloc(void)
+{
+	lck_rw_t *rw;
+
+	rw = pfs_us_malloc(sizeof *rw, M_WAITOK);
+	pthread_rwlock_init(&rw->lr_rw, NULL);
+	return (rw);
+}
+
+#define lck_mtx_init(m, grp, attr)	((m) = pfs_us_mtx_alloc())
+#define lck_rw_init(rw, grp, attr)	((rw) = pfs_us_rw_alloc())
+#define lck_mtx_destroy(m, grp) \
+	(pthread_mutex_destroy(&(m)->lm_mtx), free(m))
+#define lck_rw_destroy(rw, grp) \
+	(pthread_rwlock_destroy(&(rw)->lr_rw), free(rw))
+
+static inline void
+lck_mtx_lock(lck_mtx_t *m)
+{
+
+	pthread_mutex_lock(&m->lm_mtx);
+	m->lm_owner = pthread_self();
+	m->lm_held = 1;
+}
+
+static inline int
+lck_mtx_try_lock(lck_mtx_t *m)
+{
+
+	if (pthread_mutex_trylock(&m->lm_mtx) != 0)
+		return (0);
+	m->lm_owner = pthread_self();
+	m->lm_held = 1;
+	return (1);
+}
+
+static inline void
+lck_mtx_unlock(lck_mtx_t *m)
+{
+
+	m->lm_held = 0;
+	pthread_mutex_unlock(&m->lm_mtx);
+}
+
+static inline void
+lck_mtx_assert(lck_mtx_t *m, int type)
+{
+	int owned;
+
+	owned = __atomic_load_n(&m->lm_held, __ATOMIC_RELAXED) &&
+	    pthread_equal(m->lm_owner, pthread_self());
+	if (type == LCK_MTX_ASSERT_OWNED && !owned)
+		panic("mutex %p not owned", (void *)m);
+	if (type == LCK_MTX_ASSERT_NOTOWNED && owned)
+		panic("mutex %p owned", (void *)m);
+}
+
+#define lck_rw_lock_shared(rw)		pthread_rwlock_rdlock(&(rw)->lr_rw)
+#define lck_rw_lock_exclusive(rw)	pthread_rwlock_wrlock(&(rw)->lr_rw)
+#define lck_rw_unlock_shared(rw)	pthread_rwlock_unlock(&(rw)->lr_rw)
+#define lck_rw_unlock_exclusive(rw)	pthread_rwlock_unlock(&(rw)->lr_rw)
+
+/*
+ * Sleep and wakeup.  Every wakeup() wakes every sleeper; callers
+ * recheck their condition anyway.
+ */
+extern pthread_mutex_t pfs_us_sleeplock;
+extern pthread_cond_t pfs_us_sleepcv;
+extern unsigned long pfs_us_sleepgen;
+
+static inline int
+msleep(void *chan, lck_mtx_t *m, int pri, const char *wmesg, void *ts)
+{
+	unsigned long gen;
+
+	pthread_mutex_lock(&pfs_us_sleeplock);
+	gen = pfs_us_sleepgen;
+	lck_mtx_unlock(m);
+	while (gen == pfs_us_sleepgen)
+		pthread_cond_wait(&pfs_us_sleepcv, &pfs_us_sleeplock);
+	pthread_mutex_unlock(&pfs_us_sleeplock);
+	lck_mtx_lock(m);
+	return (0);
+}
+
+static inline void
+wakeup(void *chan)
+{
+
+	pthread_mutex_lock(&pfs_us_sleeplock);
+	pfs_us_sleepgen++;
+	pthread_cond_broadcast(&pfs_us_sleepcv);
+	pthread_mutex_unlock(&pfs_us_sleeplock);
+}
+
+/*
+ * Threads, CPUs and time
+ */
+#define current_thread()	pthread_self()
+#define thread_deallocate(t)	pthread_detach(t)
+#define thread_terminate(t)	pthread_exit(NULL)
+
+kern_return_t	kernel_thread_start(void (*)(void *, wait_result_t), void *,
+		    thread_t *);
+
+static inline int
+cpu_number(void)
+{
+	int cpu;
+
+	cpu = sched_getcpu();
+	return (cpu < 0 ? 0 : cpu);
+}
+
+static inline uint64_t
+mach_absolute_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+#define absolutetime_to_nanoseconds(abs, nsp)	(*(nsp) = (abs))
+#define NSEC_PER_SEC				1000000000ULL
+
+static inline void
+clock_interval_to_deadline(uint32_t interval, uint32_t scale,
+    uint64_t *deadline)
+{
+
+	*deadline = mach_absolute_time() + (uint64_t)interval * scale;
+}
+
+/*
+ * Thread calls never fire; the test programs call their functions
+ * directly.
+ */
+typedef void			*thread_call_param_t;
+typedef void			(*thread_call_func_t)(thread_call_param_t,
+				    thread_call_param_t);
+typedef thread_call_func_t	 thread_call_t;
+
+static inline thread_call_t
+thread_call_allocate(thread_call_func_t func, thread_call_param_t param)
+{
+
+	return (func);
+}
+
+static inline int
+thread_call_enter_delayed(thread_call_t call, uint64_t deadline)
+{
+
+	return (0);
+}
+
+static inline int
+thread_call_cancel_wait(thread_call_t call)
+{
+
+	return (0);
+}
+
+static inline int
+thread_call_free(thread_call_t call)
+{
+
+	return (1);
+}
+#define delay(usec)				sched_yield()
+
+/*
+ * Sysctls are compiled in as unused references to their handlers and
+ * variables, so that nothing they export looks unused.
+ */
+struct sysctl_oid;
+struct sysctl_req {
+	user_addr_t		 newptr;
+};
+
+#define USER_ADDR_NULL		((user_addr_t)0)
+#define SYSCTL_HANDLER_ARGS \
+	struct sysctl_oid *oidp, void *arg1, int arg2, struct sysctl_req *req
+#define SYSCTL_OUT(req, p, len)	((void)(p), (void)(len), 0)
+#define SYSCTL_IN(req, p, len)	((void)(p), (void)(len), 0)
+#define SYSCTL_DECL(name)	extern int pfs_us_sysctl_##name
+#define SYSCTL_NODE(parent, nbr, name, ...) \
+	int pfs_us_sysctl_##parent##_##name __attribute__((unused))
+#define SYSCTL_INT(parent, nbr, name, access, ptr, ...) \
+	static void *pfs_us_sysctl_##parent##_##name \
+	    __attribute__((unused)) = (void *)(ptr)
+#define SYSCTL_QUAD		SYSCTL_INT
+#define SYSCTL_ULONG		SYSCTL_INT
+#define SYSCTL_PROC(parent, nbr, name, access, ptr, arg, handler, ...) \
+	static void *pfs_us_sysctl_##parent##_##name \
+	    __attribute__((unused)) = (void *)(handler)
+
+/*
+ * Processes, mounts and vnodes; see pfs_userspace.c.
+ */
+struct proc {
+	pid_t			 p_pid;
+};
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE		4096
+#endif
+#define MNAMELEN		90
+
+struct statfs {
+	uint32_t		 f_bsize;
+	int32_t			 f_iosize;
+	uint64_t		 f_blocks;
+	uint64_t		 f_bfree;
+	uint64_t		 f_bavail;
+	uint64_t		 f_files;
+	uint64_t		 f_ffree;
+	char			 f_mntfromname[MNAMELEN];
+};
+
+/* no process exists in the test programs */
+static inline struct proc *
+proc_find(int pid)
+{
+
+	return (NULL);
+}
+
+static inline int
+proc_rele(struct proc *p)
+{
+
+	return (0);
+}
+
+struct mount {
+	int			 mnt_id;
+	int			 mnt_flag;
+	int			 mnt_kern_flag;
+	void			*mnt_data;
+	struct statfs		 mnt_vfsstat;
+};
+
+enum vtype { VNON, VREG, VDIR, VBLK, VCHR, VLNK, VSOCK, VFIFO, VBAD };
+
+struct vnode {
+	pthread_mutex_t		 v_mtx;
+	uint32_t		 v_id;		/* vid */
+	int			 v_iocount;
+	int			 v_usecount;
+	int			 v_state;
+	uint32_t		 v_flag;
+	enum vtype		 v_type;
+	struct mount		*v_mount;
+	void			*v_data;
+	struct vnode		*v_freelink;
+};
+
+struct vnode_attr;
+struct componentname;
+struct vattr;
+struct vnode_attr { int va_unused; };
+
+#define NULLVP			((struct vnode *)NULL)
+#define VV_ROOT			0x0001
+#define VV_PROCDEP		0x0002
+#define VN_LOCK_AREC(vp)	do { } while (0)
+#define VI_LOCK(vp)		do { } while (0)
+#define LK_EXCLUSIVE		0
+#define PROC_LOCK_ASSERT(p, t)	do { } while (0)
+#define PROC_ASSERT_HELD(p)	do { } while (0)
+
+int		vnode_create_empty(struct vnode **);
+int		vnode_getwithvid(struct vnode *, uint32_t);
+uint32_t	vnode_vid(struct vnode *);
+int		vnode_put(struct vnode *);
+int		vnode_ref(struct vnode *);
+void		vnode_rele(struct vnode *);
+int		vnode_recycle(struct vnode *);
+int		vnode_isinuse(struct vnode *, int);
+void		cache_purge(struct vnode *);
+
+/*
+ * Mounting and module glue, for pseudofs_vfsops.c.  The test programs
+ * never mount anything; these only have to compile and link.
+ */
+struct mntarg;
+struct vfsconf;
+typedef void		*vfs_context_t;
+typedef struct kmod_info { int unused; } kmod_info_t;
+typedef kern_return_t	 kmod_start_func_t(kmod_info_t *, void *);
+typedef kern_return_t	 kmod_stop_func_t(kmod_info_t *, void *);
+
+#define MNT_UPDATE		0x0001
+#define MNT_LOCAL		0x0002
+#define MNT_FORCE		0x0004
+#define MNT_DONTBROWSE		0x0008
+#define MNTK_NOMSYNC		0x0001
+#define FORCECLOSE		0x0002
+#define KERNEL_MOUNT_NOAUTH	0x0001
+#define MNT_ILOCK(mp)		do { } while (0)
+#define MNT_IUNLOCK(mp)		do { } while (0)
+
+#define KEXTNAME_S		"pfstest"
+#define KMOD_EXPLICIT_DECL(name, version, start, stop)
+#define __private_extern__	static __attribute__((unused))
+#define __APPLE_CC__		0
+
+#define strlcpy			pfs_us_strlcpy
+
+size_t		pfs_us_strlcpy(char *, const char *, size_t);
+int		copystr(const void *, void *, size_t, size_t *);
+struct statfs	*vfs_statfs(struct mount *);
+void		vfs_getnewfsid(struct mount *);
+vfs_context_t	vfs_context_kernel(void);
+int		kernel_mount(char *, struct vnode *, struct vnode *,
+		    const char *, void *, size_t, int, uint32_t,
+		    vfs_context_t);
+int		vflush(struct mount *, struct vnode *, int);
+
+#endif /* _PFS_USERSPACE_H */
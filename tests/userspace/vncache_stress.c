@@ -0,0 +1,694 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Concurrent stress and throughput test for the pseudofs vnode cache.
+ *
+ * The cache is built from src/pseudofs_vncache.c as is, on top of the
+ * userspace runtime in pfs_userspace.c.  The program runs four phases:
+ *
+ * vdata	One thread allocates and frees batches of entries through
+ *		the object cache.  After the first batch has been through
+ *		it, no allocation may reach malloc() and the footprint may
+ *		not grow.  The cost of a pair is compared with malloc() and
+ *		free().  A burst of frees far larger than the depot must
+ *		leave no more cached than the depot holds.  The phase waits
+ *		for the reclaim worker to fill the vnode pool first, since
+ *		the pool takes its entries from the same cache.
+ *
+ * throughput	Readers look up random (node, pid) pairs of a working set
+ *		that fits in the cache, for each thread count in turn, and
+ *		the rate of lookups is reported.  Nearly every lookup is a
+ *		hit served by the lock-free walk.  Each count is run again
+ *		with every lookup serialized behind one mutex, as all of
+ *		them were behind pfs_vncache_mutex before the table was
+ *		striped, which gives the curve to compare against.
+ *
+ * stress	Readers keep looking up entries while a churn thread makes
+ *		the table grow and shrink by moving maxentries, so that hits
+ *		race with migrations, evictions and deferred frees, purges
+ *		nodes, destroys and replaces them, exits processes, empties
+ *		the cache, shrinks the caches as memory pressure would, and
+ *		reaps freed entries.  Every vnode a lookup returns must
+ *		belong to the node and pid that were asked for, and some
+ *		misses must have been served by the vnode pool.  Once the
+ *		threads have stopped, every live entry must still be
+ *		attached to its vnode, no key may have two live entries, and
+ *		the entry count must agree with the tables.
+ *
+ * purge	A vnode is cached for every (node, pid) pair, then revoked
+ *		through pfs_purge() for one node, pfs_exit() for one pid and
+ *		the exit sweep for the rest, to which every pid looks dead
+ *		here; then the same again, with pfs_purge(NULL) for the rest,
+ *		which must leave no entry on any node, pid or ring list.
+ *		The entry count must drop by as much as was revoked each
+ *		time, every vnode must have been reclaimed once the reclaim
+ *		worker has drained its queue, and the table must have grown
+ *		with the entries and shrunk again as they went away.  A node
+ *		is also destroyed while a reference is held on it: it may
+ *		not be cached again, and must be freed once the reference is
+ *		dropped.
+ *
+ * Finally the cache is filled once more and torn down the way pfs_uninit()
+ * and the module unload do it, so that the cache instance is destroyed
+ * while the reclaim worker still has its vnodes queued.
+ *
+ * Usage: vncache_stress [-d msec] [-t maxthreads]
+ */
+
+#include "pseudofs_vncache.c"
+
+#define NNODES		64
+#define NPIDS		64
+
+int maxproc = 1024;
+
+static struct pfs_info test_info = { "pfstest" };
+static struct mount test_mount;
+static struct pfs_node *test_nodes[NNODES];
+
+static pthread_rwlock_t test_treelock = PTHREAD_RWLOCK_INITIALIZER;
+
+static volatile int test_stop;
+static SInt32 test_nodecount;		/* nodes not freed yet */
+static volatile int test_churn;		/* readers take test_treelock */
+static int test_serialize;		/* readers take test_biglock */
+static pthread_mutex_t test_biglock = PTHREAD_MUTEX_INITIALIZER;
+
+extern long pfs_us_vnodes, pfs_us_reclaims;
+
+/*
+ * What pfs_vfsops.c does for nodes, minus the tree.
+ */
+void
+pfs_node_hold(struct pfs_node *pn)
+{
+
+	OSIncrementAtomic(&pn->pn_refs);
+}
+
+void
+pfs_node_rele(struct pfs_node *pn)
+{
+
+	if (OSDecrementAtomic(&pn->pn_refs) > 1)
+		return;
+	KASSERT(pn->pn_dead, ("last reference to live node %s", pn->pn_name));
+	lck_mtx_destroy(pn->pn_mutex, NULL);
+	free(pn);
+	OSDecrementAtomic(&test_nodecount);
+}
+
+static struct pfs_node *
+test_node_alloc(int i)
+{
+	struct pfs_node *pn;
+
+	pn = pfs_us_malloc(sizeof *pn, M_WAITOK);
+	lck_mtx_init(pn->pn_mutex, NULL, LCK_SLEEP_DEFAULT);
+	snprintf(pn->pn_name, sizeof pn->pn_name, "node%d", i);
+	pn->pn_type = i == 0 ? pfstype_dir : pfstype_file;
+	pn->pn_info = &test_info;
+	pn->pn_fileno = i + 3;
+	pn->pn_refs = 1;
+	LIST_INIT(&pn->pn_vdata);
+	OSIncrementAtomic(&test_nodecount);
+	return (pn);
+}
+
+/*
+ * What pfs_destroy() does once a node is detached from the tree.
+ */
+static void
+test_node_destroy(struct pfs_node *pn)
+{
+
+	pfs_lock(pn);
+	pn->pn_dead = 1;
+	pfs_unlock(pn);
+	pfs_purge(pn);
+	KASSERT(LIST_EMPTY(&pn->pn_vdata),
+	    ("destroyed node %s still has cached vnodes", pn->pn_name));
+	pfs_node_rele(pn);
+}
+
+static uint32_t
+test_random(uint64_t *state)
+{
+
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return ((uint32_t)(*state >> 16));
+}
+
+struct test_reader {
+	pthread_t	 tr_thread;
+	uint64_t	 tr_seed;
+	uint64_t	 tr_ops;
+	uint64_t	 tr_enoent;
+};
+
+static void *
+test_reader_main(void *arg)
+{
+	struct test_reader *tr;
+	struct pfs_vdata *pvd;
+	struct pfs_node *pn;
+	struct vnode *vp;
+	uint32_t r;
+	pid_t pid;
+	int churn, error;
+
+	tr = arg;
+	while (!test_stop) {
+		r = test_random(&tr->tr_seed);
+		pid = (r >> 8) % (NPIDS + 1);
+		if (pid == NPIDS)
+			pid = NO_PID;
+		/* the tree lock stands in for the parent vnode's lock */
+		churn = test_churn;
+		if (churn) {
+			pthread_rwlock_rdlock(&test_treelock);
+			pn = test_nodes[r % NNODES];
+			pfs_node_hold(pn);
+			pthread_rwlock_unlock(&test_treelock);
+		} else {
+			pn = test_nodes[r % NNODES];
+		}
+		if (test_serialize)
+			pthread_mutex_lock(&test_biglock);
+		error = pfs_vncache_alloc(&test_mount, &vp, pn, pid);
+		if (error == 0) {
+			pvd = vp->v_data;
+			if (pvd == NULL || pvd->pvd_pn != pn ||
+			    pvd->pvd_pid != pid || vp->v_mount != &test_mount)
+				panic("lookup of (%s, %d) returned %p for "
+				    "(%s, %d)", pn->pn_name, pid, (void *)vp,
+				    pvd == NULL ? "none" : pvd->pvd_pn->pn_name,
+				    pvd == NULL ? -1 : pvd->pvd_pid);
+			vnode_put(vp);
+		} else if (error == ENOENT) {
+			/* the node was destroyed under us */
+			tr->tr_enoent++;
+		} else {
+			panic("pfs_vncache_alloc(): error %d", error);
+		}
+		if (test_serialize)
+			pthread_mutex_unlock(&test_biglock);
+		if (churn)
+			pfs_node_rele(pn);
+		tr->tr_ops++;
+	}
+	return (NULL);
+}
+
+static uint64_t
+test_now_ns(void)
+{
+
+	return (mach_absolute_time());
+}
+
+static int
+test_entries(void)
+{
+
+	return ((int)PFS_VNCACHE_ENTRIES());
+}
+
+static uint64_t
+test_run_readers(int nthreads, int msec, uint64_t *enoentp)
+{
+	struct test_reader *tr;
+	uint64_t ops;
+	int i;
+
+	tr = pfs_us_malloc(nthreads * sizeof *tr, M_WAITOK);
+	test_stop = 0;
+	for (i = 0; i < nthreads; i++) {
+		tr[i].tr_seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		if (pthread_create(&tr[i].tr_thread, NULL, test_reader_main,
+		    &tr[i]) != 0)
+			panic("pthread_create");
+	}
+	usleep(msec * 1000);
+	test_stop = 1;
+	ops = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tr[i].tr_thread, NULL);
+		ops += tr[i].tr_ops;
+		if (enoentp != NULL)
+			*enoentp += tr[i].tr_enoent;
+	}
+	free(tr);
+	return (ops);
+}
+
+/*
+ * Throughput for 1, 2, 4, ... threads over a resident working set, with
+ * the cache as it is and with lookups serialized.
+ */
+static void
+test_throughput(int maxthreads, int msec)
+{
+	int64_t hits, misses;
+	uint64_t ops, ops1, t0, t1, t2;
+	int n;
+
+	/* warm up: every key ends up cached */
+	test_run_readers(1, msec, NULL);
+	printf("%8s %14s %14s %8s\n", "threads", "lookups/s", "one lock/s",
+	    "hit%");
+	for (n = 1; n <= maxthreads; n *= 2) {
+		hits = pfs_vncache_counter(
+		    offsetof(struct pfs_vncache_pcpu, pc_hits));
+		misses = pfs_vncache_counter(
+		    offsetof(struct pfs_vncache_pcpu, pc_misses));
+		t0 = test_now_ns();
+		ops = test_run_readers(n, msec, NULL);
+		t1 = test_now_ns();
+		hits = pfs_vncache_counter(
+		    offsetof(struct pfs_vncache_pcpu, pc_hits)) - hits;
+		misses = pfs_vncache_counter(
+		    offsetof(struct pfs_vncache_pcpu, pc_misses)) - misses;
+		test_serialize = 1;
+		ops1 = test_run_readers(n, msec, NULL);
+		test_serialize = 0;
+		t2 = test_now_ns();
+		printf("%8d %14.0f %14.0f %8.2f\n", n,
+		    ops * 1e9 / (double)(t1 - t0),
+		    ops1 * 1e9 / (double)(t2 - t1),
+		    hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+	}
+}
+
+#define TEST_VDBATCH	100
+#define TEST_VDROUNDS	20000
+#define TEST_VDBURST	(4 * PFS_VDCACHE_DEPOTMAX * PFS_VDMAG_SIZE)
+
+/*
+ * Entries allocated from the per-CPU magazines and from malloc().
+ */
+static void
+test_vdata_counters(uint64_t *hitsp, uint64_t *missesp)
+{
+	int i;
+
+	*hitsp = *missesp = 0;
+	for (i = 0; i < PFS_VDCACHE_NCPU; i++) {
+		*hitsp += pfs_vdcache_cpu[i].vc_hits;
+		*missesp += pfs_vdcache_cpu[i].vc_misses;
+	}
+}
+
+static uint64_t
+test_vdata_bytes(void)
+{
+
+	return ((uint64_t)pfs_vdcache_nobjs * sizeof(struct pfs_vdata) +
+	    (uint64_t)pfs_vdcache_nmags * sizeof(struct pfs_vdmag));
+}
+
+/*
+ * Steady-state miss/reclaim cycles, on one CPU so that they all go
+ * through the same magazines, then one burst past the depot's limit.
+ */
+static void
+test_vdata(void)
+{
+	struct pfs_vdata *pvd[TEST_VDBATCH], **burst;
+	uint64_t bytes, hits, misses, hits0, misses0, t0, t1, t2;
+	cpu_set_t cpus, ocpus;
+	int i, r;
+
+	/* the worker fills the vnode pool from the same cache at load */
+	for (;;) {
+		lck_mtx_lock(pfs_vncache_poollock);
+		i = pfs_vncache_poolcount;
+		lck_mtx_unlock(pfs_vncache_poollock);
+		if (i >= pfs_vncache_pool_target())
+			break;
+		usleep(1000);
+	}
+
+	pthread_getaffinity_np(pthread_self(), sizeof ocpus, &ocpus);
+	CPU_ZERO(&cpus);
+	CPU_SET(sched_getcpu(), &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+
+	/* the first batch fills the magazines and the depot */
+	for (i = 0; i < TEST_VDBATCH; i++)
+		pvd[i] = pfs_vdata_alloc();
+	for (i = 0; i < TEST_VDBATCH; i++)
+		pfs_vdata_free(pvd[i]);
+	bytes = test_vdata_bytes();
+	test_vdata_counters(&hits0, &misses0);
+
+	t0 = test_now_ns();
+	for (r = 0; r < TEST_VDROUNDS; r++) {
+		for (i = 0; i < TEST_VDBATCH; i++)
+			pvd[i] = pfs_vdata_alloc();
+		for (i = TEST_VDBATCH - 1; i >= 0; i--)
+			pfs_vdata_free(pvd[i]);
+	}
+	t1 = test_now_ns();
+	for (r = 0; r < TEST_VDROUNDS; r++) {
+		for (i = 0; i < TEST_VDBATCH; i++)
+			pvd[i] = malloc(sizeof *pvd[i], M_PFSVNCACHE,
+			    M_WAITOK);
+		for (i = TEST_VDBATCH - 1; i >= 0; i--)
+			FREE(pvd[i], M_PFSVNCACHE);
+	}
+	t2 = test_now_ns();
+	test_vdata_counters(&hits, &misses);
+	KASSERT(misses == misses0, ("%llu steady-state allocations reached "
+	    "malloc", (unsigned long long)(misses - misses0)));
+	KASSERT(hits - hits0 == (uint64_t)TEST_VDROUNDS * TEST_VDBATCH,
+	    ("%llu magazine hits", (unsigned long long)(hits - hits0)));
+	KASSERT(test_vdata_bytes() == bytes, ("footprint grew from %llu to "
+	    "%llu bytes", (unsigned long long)bytes,
+	    (unsigned long long)test_vdata_bytes()));
+	printf("vdata:    %.1f ns per cached pair, %.1f ns per malloc pair, "
+	    "%llu bytes held\n",
+	    (double)(t1 - t0) / ((double)TEST_VDROUNDS * TEST_VDBATCH),
+	    (double)(t2 - t1) / ((double)TEST_VDROUNDS * TEST_VDBATCH),
+	    (unsigned long long)bytes);
+
+	/* the depot and this CPU's two magazines keep the rest */
+	burst = pfs_us_malloc(TEST_VDBURST * sizeof *burst, M_WAITOK);
+	for (i = 0; i < TEST_VDBURST; i++)
+		burst[i] = pfs_vdata_alloc();
+	for (i = 0; i < TEST_VDBURST; i++)
+		pfs_vdata_free(burst[i]);
+	free(burst);
+	/* the pooled vnodes hold entries of their own */
+	KASSERT(pfs_vdcache_nobjs <=
+	    (PFS_VDCACHE_DEPOTMAX + 2) * PFS_VDMAG_SIZE +
+	    pfs_vncache_poolcount,
+	    ("%d objects cached after a burst", (int)pfs_vdcache_nobjs));
+
+	pthread_setaffinity_np(pthread_self(), sizeof ocpus, &ocpus);
+}
+
+struct test_churn_stats {
+	uint64_t	 tc_grow;
+	uint64_t	 tc_shrink;
+	uint64_t	 tc_purges;
+	uint64_t	 tc_destroys;
+	uint64_t	 tc_exits;
+	uint64_t	 tc_empties;
+	uint64_t	 tc_shrinks;
+};
+
+static void *
+test_churn_main(void *arg)
+{
+	struct test_churn_stats *tc;
+	struct pfs_node *pn;
+	uint64_t seed;
+	uint32_t r;
+	int i;
+
+	tc = arg;
+	seed = 0xdeadbeefcafef00dULL;
+	while (!test_stop) {
+		r = test_random(&seed);
+		switch (r % 8) {
+		case 0:
+			/* let the table grow */
+			pfs_vncache_maxentries = 0x7fffffff;
+			tc->tc_grow++;
+			break;
+		case 1:
+			/* evict down to a handful; the table shrinks */
+			pfs_vncache_maxentries = 16;
+			pfs_vncache_evict(PFS_VNCACHE_SCAN);
+			tc->tc_shrink++;
+			break;
+		case 2:
+			pfs_purge(test_nodes[(r >> 8) % NNODES]);
+			tc->tc_purges++;
+			break;
+		case 3:
+			i = 1 + (r >> 8) % (NNODES - 1);
+			pthread_rwlock_wrlock(&test_treelock);
+			pn = test_nodes[i];
+			test_nodes[i] = test_node_alloc(i);
+			pthread_rwlock_unlock(&test_treelock);
+			test_node_destroy(pn);
+			tc->tc_destroys++;
+			break;
+		case 4:
+		case 5:
+			pfs_exit((r >> 8) % NPIDS);
+			tc->tc_exits++;
+			break;
+		case 6:
+			/* the table shrinks, and grows back with the readers */
+			if ((r & 0x700) == 0) {
+				pfs_purge(NULL);
+				tc->tc_empties++;
+			} else if ((r & 0x700) == 0x100) {
+				pfs_vncache_shrink();
+				tc->tc_shrinks++;
+			}
+			break;
+		case 7:
+			pfs_vncache_reap();
+			break;
+		}
+		if ((r & 0x300) == 0)
+			sched_yield();
+	}
+	return (NULL);
+}
+
+/*
+ * Walk both tables of an instance with every lock held: every live entry
+ * must still be attached to its vnode, and the entry counts must match
+ * what is there.
+ */
+static void
+test_check_tables(struct pfs_vncache *vc)
+{
+	struct pfs_vncache_head *tbl;
+	struct pfs_vdata *pvd, *pvd2;
+	u_long hash, i;
+	int live, n, t;
+
+	lck_rw_lock_exclusive(vc->vc_tbllock);
+	n = 0;
+	for (t = 0; t < 2; t++) {
+		tbl = t == 0 ? vc->vc_hashtbl : vc->vc_oldtbl;
+		hash = t == 0 ? vc->vc_hash : vc->vc_oldhash;
+		if (tbl == NULL)
+			continue;
+		for (i = 0; i <= hash; i++) {
+			SLIST_FOREACH(pvd, &tbl[i], pvd_hash) {
+				n++;
+				KASSERT((pvd->pvd_flags & PVD_HASHED) != 0,
+				    ("unhashed entry %p on a chain", pvd));
+				if ((pvd->pvd_flags & PVD_DEAD) != 0)
+					continue;
+				KASSERT(pvd->pvd_vnode->v_data == pvd,
+				    ("live entry %p lost its vnode", pvd));
+				live = 0;
+				SLIST_FOREACH(pvd2, &tbl[i], pvd_hash)
+					if (pfs_vncache_match(pvd2,
+					    pvd->pvd_hashval, pvd->pvd_pn,
+					    pvd->pvd_pid,
+					    pvd->pvd_vnode->v_mount))
+						live++;
+				KASSERT(live == 1, ("%d live entries for "
+				    "(%s, %d)", live, pvd->pvd_pn->pn_name,
+				    pvd->pvd_pid));
+			}
+		}
+	}
+	KASSERT(n == vc->vc_entries, ("%d entries hashed, vc_entries %d",
+	    n, (int)vc->vc_entries));
+	KASSERT(n == test_entries(), ("%d entries hashed, "
+	    "pc_entries %d", n, test_entries()));
+	lck_rw_unlock_exclusive(vc->vc_tbllock);
+	printf("tables:   %d entries on %lu chains, %lu resizes\n", n,
+	    vc->vc_hash + 1, vc->vc_resizes);
+}
+
+static void
+test_stress(int nthreads, int msec)
+{
+	struct test_churn_stats tc;
+	pthread_t churn;
+	uint64_t enoent, ops, vdhits, vdmisses, vdhits0, vdmisses0;
+	u_long resizes;
+	int maxentries;
+
+	memset(&tc, 0, sizeof tc);
+	maxentries = pfs_vncache_maxentries;
+	test_vdata_counters(&vdhits0, &vdmisses0);
+	resizes = pfs_vncache_resizes;
+	test_churn = 1;
+	test_stop = 0;
+	if (pthread_create(&churn, NULL, test_churn_main, &tc) != 0)
+		panic("pthread_create");
+	enoent = 0;
+	ops = test_run_readers(nthreads, msec, &enoent);
+	pthread_join(churn, NULL);
+	test_churn = 0;
+	pfs_vncache_maxentries = maxentries;
+	pfs_vncache_reclaim_drain();
+	pfs_vncache_reap();
+
+	printf("stress:   %llu lookups by %d threads, %llu on destroyed "
+	    "nodes\n", (unsigned long long)ops, nthreads,
+	    (unsigned long long)enoent);
+	printf("churn:    %llu grows, %llu shrinks, %llu purges, %llu "
+	    "destroys, %llu exits, %llu empties, %llu cache shrinks\n",
+	    (unsigned long long)tc.tc_grow, (unsigned long long)tc.tc_shrink,
+	    (unsigned long long)tc.tc_purges,
+	    (unsigned long long)tc.tc_destroys,
+	    (unsigned long long)tc.tc_exits,
+	    (unsigned long long)tc.tc_empties,
+	    (unsigned long long)tc.tc_shrinks);
+	test_vdata_counters(&vdhits, &vdmisses);
+	printf("entries:  %llu from magazines, %llu from malloc\n",
+	    (unsigned long long)(vdhits - vdhits0),
+	    (unsigned long long)(vdmisses - vdmisses0));
+	printf("cache:    %d evictions, %d skipped in use, %llu reclaimed by "
+	    "the worker, %llu vnode pool hits\n", pfs_vncache_evictions,
+	    pfs_vncache_evictbusy, (unsigned long long)pfs_vncache_reclaimed,
+	    (unsigned long long)pfs_vncache_poolhits);
+	test_check_tables(test_info.pi_vncache);
+	KASSERT(pfs_vncache_resizes > resizes, ("the table was never resized"));
+	KASSERT(pfs_vncache_poolhits > 0, ("no miss was served by the pool"));
+}
+
+/*
+ * Cache a vnode for every (node, pid) pair and hold on to none of them.
+ */
+static void
+test_fill(void)
+{
+	struct vnode *vp;
+	int i, pid;
+
+	for (i = 0; i < NNODES; i++)
+		for (pid = 0; pid < NPIDS; pid++) {
+			if (pfs_vncache_alloc(&test_mount, &vp, test_nodes[i],
+			    pid) != 0)
+				panic("pfs_vncache_alloc");
+			vnode_put(vp);
+		}
+	KASSERT(test_entries() == NNODES * NPIDS,
+	    ("%d entries cached", test_entries()));
+}
+
+static void
+test_purge(void)
+{
+	struct pfs_vncache *vc;
+	struct pfs_node *pn;
+	struct vnode *vp;
+	u_long hash;
+	long reclaims;
+	int i;
+
+	vc = test_info.pi_vncache;
+	pfs_purge(NULL);
+	pfs_vncache_reclaim_drain();
+	reclaims = pfs_us_reclaims;
+	test_fill();
+	KASSERT(vc->vc_hash > vc->vc_minhash, ("the table did not grow"));
+	hash = vc->vc_hash;
+	pfs_purge(test_nodes[1]);
+	KASSERT(test_entries() == (NNODES - 1) * NPIDS,
+	    ("%d entries left after purging a node", test_entries()));
+	pfs_exit(1);
+	KASSERT(test_entries() == (NNODES - 1) * (NPIDS - 1),
+	    ("%d entries left after an exit", test_entries()));
+	pfs_exit_sweep(NULL, NULL);
+	KASSERT(test_entries() == 0,
+	    ("%d entries left after the exit sweep", test_entries()));
+	pfs_vncache_reclaim_drain();
+	KASSERT(vc->vc_hash < hash, ("the table did not shrink"));
+
+	test_fill();
+	pfs_purge(NULL);
+	KASSERT(test_entries() == 0,
+	    ("%d entries left after purging all", test_entries()));
+	for (i = 0; i < NNODES; i++)
+		KASSERT(LIST_EMPTY(&test_nodes[i]->pn_vdata),
+		    ("node %d still lists entries", i));
+	for (i = 0; i <= (int)pfs_vncache_pidhash; i++)
+		KASSERT(LIST_EMPTY(&pfs_vncache_pidtbl[i]),
+		    ("pid records left after purging all"));
+	KASSERT(pfs_vncache_nclock == 0,
+	    ("%d entries left on the ring", pfs_vncache_nclock));
+	pfs_vncache_reclaim_drain();
+	KASSERT(pfs_us_reclaims - reclaims == 2 * NNODES * NPIDS,
+	    ("%ld vnodes reclaimed", pfs_us_reclaims - reclaims));
+
+	/* a destroyed node outlives its last reference, uncached */
+	pn = test_nodes[2];
+	pfs_node_hold(pn);
+	test_node_destroy(pn);
+	KASSERT(test_nodecount == NNODES, ("node freed while held"));
+	KASSERT(pfs_vncache_alloc(&test_mount, &vp, pn, 0) == ENOENT,
+	    ("destroyed node cached again"));
+	KASSERT(test_entries() == 0, ("%d entries cached", test_entries()));
+	pfs_node_rele(pn);
+	KASSERT(test_nodecount == NNODES - 1, ("destroyed node leaked"));
+	test_nodes[2] = test_node_alloc(2);
+
+	printf("purge:    %d entries revoked, %lu resizes\n",
+	    2 * NNODES * NPIDS, vc->vc_resizes);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long ncpu;
+	int ch, i, maxthreads, msec;
+
+	msec = 500;
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	maxthreads = ncpu > 1 ? (int)ncpu : 2;
+	while ((ch = getopt(argc, argv, "d:t:")) != -1) {
+		switch (ch) {
+		case 'd':
+			msec = atoi(optarg);
+			break;
+		case 't':
+			maxthreads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+			    "usage: vncache_stress [-d msec] [-t maxthreads]\n");
+			return (1);
+		}
+	}
+	if (msec <= 0 || maxthreads <= 0)
+		return (1);
+
+	pfs_vncache_load();
+	pfs_vncache_create(&test_info);
+	for (i = 0; i < NNODES; i++)
+		test_nodes[i] = test_node_alloc(i);
+
+	test_vdata();
+	test_throughput(maxthreads, msec);
+	test_stress(MAX(maxthreads, 4), 4 * msec);
+	test_purge();
+
+	/* what pfs_uninit() and the module unload do */
+	test_fill();
+	for (i = 0; i < NNODES; i++)
+		test_node_destroy(test_nodes[i]);
+	pfs_vncache_destroy(&test_info);
+	pfs_vncache_unload();
+	KASSERT(test_nodecount == 0, ("%d nodes leaked", (int)test_nodecount));
+	printf("vnodes:   %ld allocated, %ld reclaims\n", pfs_us_vnodes,
+	    pfs_us_reclaims);
+	printf("ok\n");
+	return (0);
+}